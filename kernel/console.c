@@ -111,8 +111,10 @@ consoleread(int user_dst, uint64 dst, int n)
 
     // copy the input byte to the user-space buffer.
     cbuf = c;
-    if(either_copyout(user_dst, dst, &cbuf, 1) == -1)
+    if(either_copyout(user_dst, dst, &cbuf, 1) == -1){
+      cons.r--;  // keep it for the next read
       break;
+    }
 
     dst++;
     --n;
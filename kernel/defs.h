@@ -2,12 +2,14 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
 struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vma;
 
 // bio.c
 void            binit(void);
@@ -24,6 +26,7 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             execproc(struct proc*, char*, char**);
 
 // file.c
 struct file*    filealloc(void);
@@ -63,6 +66,13 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void*           kzalloc(void);
+int             kzeroidle(void);
+void*           kalloc_order(int);
+void            kfree_order(void *, int);
+void            kref(void *);
+int             krefcnt(void *);
+void            kallocstats(void);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -70,7 +80,26 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// mmap.c
+void            mmapinit(void);
+uint64          mmap(uint64, int, int, struct file*, uint64);
+int             munmap(uint64, uint64);
+uint64          mmapbase(struct proc*);
+int             mmapcopy(struct proc*, struct proc*);
+void            mmapexit(struct proc*);
+int             mmapfault(struct proc*, uint64, int);
+void            mmapprefault(uint64, uint64);
+struct vma*     vmalookup(struct proc*, uint64, uint64);
+
+// pagecache.c
+void            pcacheinit(void);
+uint64          pcacheget(struct inode*, uint);
+void            pcacheinval(struct inode*);
+int             pcachereap(void);
+void            pcachestats(void);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -82,10 +111,14 @@ void            panic(char*) __attribute__((noreturn));
 void            printfinit(void);
 
 // proc.c
+int             clone(uint64, uint64, uint64);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
-int             growproc(int);
+int             futex_wait(uint64, int);
+int             futex_wake(uint64, int);
+int             growproc(int, uint64*);
+int             join(int, uint64);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
@@ -93,17 +126,26 @@ struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
 void            procinit(void);
+void            schedstats(void);
+void            schedboost(void);
+int             schedtick(void);
+int             nice(int);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
+int             sleeping(void*);
+int             spawn(char*, char**, struct file**);
 void            userinit(void);
 int             wait(uint64);
+void            vmshootdown(struct proc*);
 void            wakeup(void*);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
+void            asidstats(void);
+void            asidflush(pagetable_t, uint64);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -116,6 +158,14 @@ void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
 
+// slab.c
+void                slabinit(void);
+struct kmem_cache*  kmem_cache_create(char*, uint);
+void*               kmem_cache_alloc(struct kmem_cache*);
+void                kmem_cache_free(struct kmem_cache*, void*);
+void                kmem_cache_reap(void);
+void                slabstats(void);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -139,8 +189,19 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// timer.c
+int             timerintr(void);
+void            timerkick(struct cpu*);
+void            timerset(void);
+int             timersleep(uint64);
+void            timerstats(void);
+int             ticksleep(uint);
+void            wheelturn(uint);
+
 // trap.c
 extern uint     ticks;
+void            clockintr(void);
+uint64          ticktime(uint);
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
@@ -156,14 +217,30 @@ int             uartgetc(void);
 // vm.c
 void            kvminit(void);
 void            kvminithart(void);
+pagetable_t     ukvmcreate(void);
+void            ukvmfree(pagetable_t);
+void            ukvmsync(struct proc*, uint64, uint64);
+void            ukvmclear(struct proc*);
 uint64          kvmpa(uint64);
 void            kvmmap(uint64, uint64, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
+int             mapleaf(pagetable_t, uint64, uint64, int, int);
+pte_t*          walk(pagetable_t, uint64, int);
+pte_t*          walklevel(pagetable_t, uint64, int, int*);
 pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmshare(pagetable_t, pagetable_t, uint64, uint64, int);
+int             uvmdup(pagetable_t, pagetable_t, uint64, uint64);
+int             uvmunshare(struct proc*);
+uint64          uvmhold(pagetable_t, uint64, int);
+void            uvmunmapthreads(struct proc*, uint64, uint64);
+int             uvmcow(pagetable_t, uint64);
+int             uvmsplit(pagetable_t, uint64);
+int             vmfault(struct proc*, uint64, int);
+void            vmstats(void);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
@@ -172,6 +249,21 @@ int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 
+// ucopy.S
+int             ucopy(char*, char*, uint64);
+int             ucopystr(char*, char*, uint64);
+
+// swap.c
+void            swapinit(int, struct superblock*);
+int             swapin(pte_t*);
+void            swapdup(pte_t);
+void            swapfree(pte_t);
+void            swapprefault(uint64, uint64);
+void            swapoff(void);
+void            swapon(void);
+int             swapreclaim(void);
+void            swapstats(void);
+
 // plic.c
 void            plicinit(void);
 void            plicinithart(void);
@@ -1,6 +1,30 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers.
+//
+// Memory is managed by a binary buddy allocator that hands
+// out physically contiguous blocks of 2^order pages, for
+// order 0 through MAXORDER. A block of order k is always
+// aligned to (PGSIZE << k), and freeing a block merges it
+// with its buddy whenever the buddy is also free.
+//
+// Single pages (kalloc/kfree) go through per-CPU caches in
+// front of the buddy lists, so that allocations on different
+// harts don't contend. A CPU whose cache runs dry refills a
+// batch from the buddy lists, or steals from a sibling.
+//
+// kzalloc() hands out pages that idle harts have already
+// zeroed (see kzeroidle(), called from scheduler()), so that
+// callers needing a zeroed page don't pay for the memset.
+//
+// Every page also has a reference count, so that pages can
+// be shared (e.g. copy-on-write after fork). kalloc() returns
+// a page with count 1, kref() adds a reference, and kfree()
+// drops one and frees the page only when none are left.
+//
+// Building with KALLOC_JUNK defined (make KALLOC_JUNK=1) fills
+// freed and newly allocated pages with junk to catch dangling
+// references and uses of uninitialized memory.
 
 #include "types.h"
 #include "param.h"
@@ -10,56 +34,376 @@
 #include "defs.h"
 
 void freerange(void *pa_start, void *pa_end);
+static void buddy_free(uint64 pa, int order);
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+// max number of pages moved by one steal.
+#define NSTEAL 32
+
+// per-CPU caches refill and drain in batches of NBATCH
+// pages, and hold at most NCACHE pages.
+#define NBATCH 16
+#define NCACHE 64
+
+// pre-zeroed pages kept per CPU, and pages zeroed per
+// call to kzeroidle().
+#define NZERO 32
+#define ZBATCH 4
+
+// one entry per physical page from KERNBASE to PHYSTOP.
+#define NPAGE ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2PG(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+
+// pginfo[] of the first page of a free buddy block.
+#define PG_FREE 0x80
+#define PG_ORDER 0x7f
+
 struct run {
   struct run *next;
+  struct run *prev;   // only used on buddy lists
 };
 
+// buddy free lists, one circular list per order.
 struct {
+  struct spinlock lock;
+  struct run free[MAXORDER+1];
+  int nfree[MAXORDER+1];   // blocks on each list
+  uchar pginfo[NPAGE];
+} buddy;
+
+// reference counts, one per physical page.
+static int refcnt[NPAGE];
+
+// per-CPU caches of single pages.
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;          // pages on freelist
+  uint64 nsteal;      // pages stolen from other CPUs
+  struct run *zlist;  // pages already zeroed
+  int nzero;          // pages on zlist
+  uint64 nzhit;       // kzalloc()s served from zlist
+  uint64 nzmiss;      // kzalloc()s that had to memset
+} kmem[NCPU];
+
+static char *kmem_names[NCPU] = {
+  "kmem0", "kmem1", "kmem2", "kmem3",
+  "kmem4", "kmem5", "kmem6", "kmem7",
+};
+
+static void
+list_init(struct run *l)
+{
+  l->next = l;
+  l->prev = l;
+}
+
+static void
+list_push(struct run *l, struct run *r)
+{
+  r->next = l->next;
+  r->prev = l;
+  l->next->prev = r;
+  l->next = r;
+}
+
+static void
+list_remove(struct run *r)
+{
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+}
+
+static uint64 kinittime;  // r_time() kinit() took
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  uint64 t0 = r_time();
+
+  initlock(&buddy.lock, "buddy");
+  for(int i = 0; i <= MAXORDER; i++)
+    list_init(&buddy.free[i]);
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, kmem_names[i]);
   freerange(end, (void*)PHYSTOP);
+  kinittime = r_time() - t0;
 }
 
+// Put [pa_start, pa_end) on the buddy lists as the largest
+// aligned blocks that fit, without touching the pages
+// themselves, so boot doesn't have to write all of RAM.
 void
 freerange(void *pa_start, void *pa_end)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  uint64 p, last;
+  int order;
+
+  p = PGROUNDUP((uint64)pa_start);
+  last = PGROUNDDOWN((uint64)pa_end);
+  acquire(&buddy.lock);
+  while(p < last){
+    order = MAXORDER;
+    while(order > 0 && ((p % ((uint64)PGSIZE << order)) != 0 ||
+                        p + ((uint64)PGSIZE << order) > last))
+      order--;
+#ifdef KALLOC_JUNK
+    memset((void*)p, 1, (uint64)PGSIZE << order);
+#endif
+    buddy_free(p, order);
+    p += (uint64)PGSIZE << order;
+  }
+  release(&buddy.lock);
+}
+
+// Put the block of 2^order pages at pa on the buddy lists,
+// merging it with its buddy as long as the buddy is free.
+// Caller must hold buddy.lock.
+static void
+buddy_free(uint64 pa, int order)
+{
+  uint64 bpa;
+
+  while(order < MAXORDER){
+    bpa = pa ^ ((uint64)PGSIZE << order);
+    if(bpa < (uint64)end || bpa >= PHYSTOP)
+      break;
+    if(buddy.pginfo[PA2PG(bpa)] != (PG_FREE | order))
+      break;
+    list_remove((struct run*)bpa);
+    buddy.nfree[order]--;
+    buddy.pginfo[PA2PG(bpa)] = 0;
+    if(bpa < pa)
+      pa = bpa;
+    order++;
+  }
+  buddy.pginfo[PA2PG(pa)] = PG_FREE | order;
+  list_push(&buddy.free[order], (struct run*)pa);
+  buddy.nfree[order]++;
+}
+
+// Take a block of 2^order pages off the buddy lists,
+// splitting a larger block if necessary.
+// Caller must hold buddy.lock.
+static void *
+buddy_alloc(int order)
+{
+  struct run *r;
+  int o;
+
+  for(o = order; o <= MAXORDER; o++)
+    if(buddy.nfree[o])
+      break;
+  if(o > MAXORDER)
+    return 0;
+
+  r = buddy.free[o].next;
+  list_remove(r);
+  buddy.nfree[o]--;
+  buddy.pginfo[PA2PG(r)] = 0;
+
+  // give back the upper halves until the block is the right size.
+  while(o > order){
+    o--;
+    uint64 upper = (uint64)r + ((uint64)PGSIZE << o);
+    buddy.pginfo[PA2PG(upper)] = PG_FREE | o;
+    list_push(&buddy.free[o], (struct run*)upper);
+    buddy.nfree[o]++;
+  }
+  return (void*)r;
+}
+
+// Return up to n single pages from the local cache km
+// to the buddy lists, so they can be merged again.
+// Called with interrupts off and without km->lock held.
+static void
+kdrain(struct kmem *km, int n)
+{
+  struct run *r, *head = 0;
+
+  acquire(&km->lock);
+  for(; n > 0 && km->freelist; n--){
+    r = km->freelist;
+    km->freelist = r->next;
+    km->nfree--;
+    r->next = head;
+    head = r;
+  }
+  release(&km->lock);
+
+  if(head == 0)
+    return;
+  acquire(&buddy.lock);
+  while(head){
+    r = head;
+    head = r->next;
+    buddy_free((uint64)r, 0);
+  }
+  release(&buddy.lock);
+}
+
+// Refill km with up to NBATCH single pages from the buddy
+// lists and return one of them, or 0 if the lists are empty.
+// Called with interrupts off and without km->lock held.
+static struct run *
+krefill(struct kmem *km)
+{
+  struct run *r, *head = 0;
+  int n;
+
+  acquire(&buddy.lock);
+  for(n = 0; n < NBATCH; n++){
+    if((r = buddy_alloc(0)) == 0)
+      break;
+    r->next = head;
+    head = r;
+  }
+  release(&buddy.lock);
+
+  if(head == 0)
+    return 0;
+  r = head;
+  if(n > 1){
+    acquire(&km->lock);
+    struct run *tail = r->next;
+    while(tail->next)
+      tail = tail->next;
+    tail->next = km->freelist;
+    km->freelist = r->next;
+    km->nfree += n - 1;
+    release(&km->lock);
+  }
+  return r;
+}
+
+// Move up to half of some other CPU's free pages
+// (at most NSTEAL) onto km's list, and return one of them.
+// Called with interrupts off but without km->lock held,
+// so that two CPUs stealing from each other can't deadlock.
+static struct run *
+ksteal(struct kmem *km)
+{
+  struct kmem *victim;
+  struct run *r, *head, *tail;
+  int n;
+
+  for(victim = kmem; victim < &kmem[NCPU]; victim++){
+    if(victim == km || victim->nfree == 0)
+      continue;
+    acquire(&victim->lock);
+    n = (victim->nfree + 1) / 2;
+    if(n > NSTEAL)
+      n = NSTEAL;
+    head = tail = victim->freelist;
+    if(head == 0){
+      release(&victim->lock);
+      continue;
+    }
+    for(int i = 1; i < n; i++)
+      tail = tail->next;
+    victim->freelist = tail->next;
+    victim->nfree -= n;
+    release(&victim->lock);
+
+    // keep the first page for the caller, shelve the rest.
+    r = head;
+    acquire(&km->lock);
+    if(r != tail){
+      tail->next = km->freelist;
+      km->freelist = r->next;
+      km->nfree += n - 1;
+    }
+    km->nsteal += n;
+    release(&km->lock);
+    return r;
+  }
+  return 0;
+}
+
+// Take a page from any CPU's zeroed pool, as a last
+// resort when everything else is empty.
+static struct run *
+kzsteal(void)
+{
+  struct kmem *km;
+  struct run *r;
+
+  for(km = kmem; km < &kmem[NCPU]; km++){
+    if(km->nzero == 0)
+      continue;
+    acquire(&km->lock);
+    r = km->zlist;
+    if(r){
+      km->zlist = r->next;
+      km->nzero--;
+    }
+    release(&km->lock);
+    if(r)
+      return r;
+  }
+  return 0;
 }
 
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// call to kalloc().
 void
 kfree(void *pa)
 {
   struct run *r;
+  struct kmem *km;
+  int nfree;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  int ref = __sync_sub_and_fetch(&refcnt[PA2PG(pa)], 1);
+  if(ref > 0)
+    return;
+  if(ref < 0)
+    panic("kfree: refcnt");
+
+#ifdef KALLOC_JUNK
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  km = &kmem[cpuid()];
+  acquire(&km->lock);
+  r->next = km->freelist;
+  km->freelist = r;
+  nfree = ++km->nfree;
+  release(&km->lock);
+  if(nfree > NCACHE)
+    kdrain(km, NBATCH);
+  pop_off();
+}
+
+// Take a page from km's cache, refilling it from the buddy
+// lists or a sibling CPU if it is empty.
+// Called with interrupts off.
+static struct run *
+kget(struct kmem *km)
+{
+  struct run *r;
+
+  acquire(&km->lock);
+  r = km->freelist;
+  if(r){
+    km->freelist = r->next;
+    km->nfree--;
+  }
+  release(&km->lock);
+  if(r == 0)
+    r = krefill(km);
+  if(r == 0)
+    r = ksteal(km);
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -70,13 +414,239 @@ kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
+  push_off();
+  r = kget(&kmem[cpuid()]);
+  if(r == 0)
+    r = kzsteal();
+  pop_off();
+
+  if(r == 0){
+    // program pages no process maps, and objects cached
+    // by the slab allocator, may be pinning pages; give
+    // those back and retry.
+    pcachereap();
+    kmem_cache_reap();
+    push_off();
+    r = kget(&kmem[cpuid()]);
+    pop_off();
+  }
+
+  if(r == 0 && swapreclaim() > 0){
+    // moved some user memory out to swap.
+    push_off();
+    r = kget(&kmem[cpuid()]);
+    pop_off();
+  }
+
   if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+    refcnt[PA2PG(r)] = 1;
 
+#ifdef KALLOC_JUNK
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
   return (void*)r;
 }
+
+// Allocate one zeroed 4096-byte page of physical memory.
+// Returns 0 if the memory cannot be allocated.
+void *
+kzalloc(void)
+{
+  struct run *r;
+  struct kmem *km;
+
+  push_off();
+  km = &kmem[cpuid()];
+  acquire(&km->lock);
+  r = km->zlist;
+  if(r){
+    km->zlist = r->next;
+    km->nzero--;
+    km->nzhit++;
+  } else {
+    km->nzmiss++;
+  }
+  release(&km->lock);
+  pop_off();
+
+  if(r){
+    r->next = 0;
+    refcnt[PA2PG(r)] = 1;
+    return (void*)r;
+  }
+  if((r = kalloc()) != 0)
+    memset(r, 0, PGSIZE);
+  return (void*)r;
+}
+
+// Called by scheduler() when this CPU has nothing to run.
+// Zeroes up to ZBATCH free pages into this CPU's pool for
+// kzalloc(). Returns the number of pages zeroed, which is 0
+// once the pool is full or memory is short.
+int
+kzeroidle(void)
+{
+  struct kmem *km;
+  struct run *r;
+  int n;
+
+  push_off();
+  km = &kmem[cpuid()];
+  pop_off();
+
+  for(n = 0; n < ZBATCH && km->nzero < NZERO; n++){
+    push_off();
+    r = kget(km);
+    pop_off();
+    if(r == 0)
+      break;
+    memset(r, 0, PGSIZE);
+    push_off();
+    acquire(&km->lock);
+    r->next = km->zlist;
+    km->zlist = r;
+    km->nzero++;
+    release(&km->lock);
+    pop_off();
+  }
+  return n;
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their size. Returns 0 if no large enough block is free.
+void *
+kalloc_order(int order)
+{
+  void *pa;
+
+  if(order < 0 || order > MAXORDER)
+    panic("kalloc_order");
+  if(order == 0)
+    return kalloc();
+
+  acquire(&buddy.lock);
+  pa = buddy_alloc(order);
+  release(&buddy.lock);
+
+  if(pa == 0){
+    // pages parked in the per-CPU caches may be
+    // keeping the blocks we need from merging.
+    push_off();
+    for(int i = 0; i < NCPU; i++)
+      kdrain(&kmem[i], NCACHE + NBATCH);
+    pop_off();
+    acquire(&buddy.lock);
+    pa = buddy_alloc(order);
+    release(&buddy.lock);
+  }
+
+  if(pa == 0)
+    return 0;
+  for(int i = 0; i < (1 << order); i++)
+    refcnt[PA2PG(pa) + i] = 1;
+#ifdef KALLOC_JUNK
+  memset(pa, 5, (uint64)PGSIZE << order); // fill with junk
+#endif
+  return pa;
+}
+
+// Free a block returned by kalloc_order(order).
+// The pages must not have been shared with kref().
+void
+kfree_order(void *pa, int order)
+{
+  if(order < 0 || order > MAXORDER)
+    panic("kfree_order");
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(((uint64)pa % ((uint64)PGSIZE << order)) != 0 ||
+     (char*)pa < end || (uint64)pa + ((uint64)PGSIZE << order) > PHYSTOP)
+    panic("kfree_order");
+  for(int i = 0; i < (1 << order); i++){
+    if(refcnt[PA2PG(pa) + i] != 1)
+      panic("kfree_order: shared");
+    refcnt[PA2PG(pa) + i] = 0;
+  }
+
+#ifdef KALLOC_JUNK
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, (uint64)PGSIZE << order);
+#endif
+
+  acquire(&buddy.lock);
+  buddy_free((uint64)pa, order);
+  release(&buddy.lock);
+}
+
+// Add a reference to the allocated page pa.
+void
+kref(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kref");
+  if(__sync_fetch_and_add(&refcnt[PA2PG(pa)], 1) < 1)
+    panic("kref: free page");
+}
+
+// Return the number of references to page pa.
+int
+krefcnt(void *pa)
+{
+  return refcnt[PA2PG(pa)];
+}
+
+// Print free memory by order, fragmentation and lock
+// contention, for the kstats system call.
+void
+kallocstats(void)
+{
+  uint64 n = 0, nts = 0;
+  int cached = 0, free = 0, big = 0, largest = -1;
+
+  printf("kalloc:");
+  for(int i = 0; i < NCPU; i++){
+    printf(" %d", kmem[i].nfree);
+    cached += kmem[i].nfree;
+    n += kmem[i].lock.n;
+    nts += kmem[i].lock.nts;
+  }
+  printf(" cached\n");
+  uint64 hit = 0, miss = 0;
+  printf("kalloc:");
+  for(int i = 0; i < NCPU; i++){
+    printf(" %d", kmem[i].nzero);
+    hit += kmem[i].nzhit;
+    miss += kmem[i].nzmiss;
+  }
+  printf(" zeroed; kzalloc %ld from pool, %ld memset\n", hit, miss);
+  for(int i = 0; i < NCPU; i++)
+    if(kmem[i].nsteal)
+      printf("kalloc: cpu %d stole %ld pages\n", i, kmem[i].nsteal);
+  printf("kalloc: %ld acquires, %ld spins waiting for kmem locks\n", n, nts);
+
+  acquire(&buddy.lock);
+  printf("buddy: free blocks by order:");
+  for(int o = 0; o <= MAXORDER; o++){
+    printf(" %d", buddy.nfree[o]);
+    free += buddy.nfree[o] << o;
+    if(o >= SUPERORDER)
+      big += buddy.nfree[o] << o;
+    if(buddy.nfree[o])
+      largest = o;
+  }
+  printf("\n");
+  release(&buddy.lock);
+
+  // fraction of free memory that can't satisfy an order-SUPERORDER
+  // (2 MB) request without first merging smaller blocks.
+  printf("buddy: %d pages free, %d cached, largest order %d, "
+         "%d%% unusable for order %d\n",
+         free, cached, largest,
+         free ? (free - big) * 100 / free : 0, SUPERORDER);
+  printf("buddy: %ld acquires, %ld spins waiting for buddy lock\n",
+         buddy.lock.n, buddy.lock.nts);
+  printf("kinit: %ld timer ticks at boot\n", kinittime);
+}
@@ -27,6 +27,10 @@ main()
     binit();         // buffer cache
     iinit();         // inode cache
     fileinit();      // file table
+    slabinit();      // small-object caches
+    pipeinit();      // pipe cache
+    pcacheinit();    // page cache for program text
+    mmapinit();      // shared memory
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
     __sync_synchronize();
@@ -27,6 +27,7 @@
 
 // local interrupt controller, which contains the timer.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid))
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
 
@@ -62,6 +63,12 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   mmap()ed regions
+//   trapframes of the process's other threads
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// the threads of a process share its page table, each
+// with its trapframe in one of NTHREAD slots.
+#define THREADFRAME(slot) (TRAPFRAME - (slot)*PGSIZE)
@@ -0,0 +1,489 @@
+// Memory-mapped files.
+//
+// mmap() records a region of the address space in one of the
+// process's struct vma slots and maps nothing. The first touch
+// of each page faults, and vmfault() calls mmapfault() to read
+// that page of the file into a fresh page, or to share the
+// page cache's copy if the region is read-only. Regions are
+// placed top-down from just below the trapframes; the heap may
+// not grow into them.
+//
+// exec() records the program's segments as regions too, below
+// p->vm->sz, so a program's pages are read in as it touches them
+// and its BSS is zero-filled on demand.
+//
+// munmap() and exit() write the dirty pages of a writable
+// MAP_SHARED region back to the file. Writes to a MAP_PRIVATE
+// region never reach the file. fork() gives the child the
+// parent's pages: MAP_SHARED pages stay shared and writable,
+// MAP_PRIVATE pages become copy-on-write.
+//
+// A MAP_ANONYMOUS region has no file and starts zeroed. An
+// anonymous MAP_SHARED region is shared memory: its pages
+// belong to a struct shm that fork() shares between parent
+// and child, so both see the same page even if it is first
+// touched after the fork.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+#include "defs.h"
+
+#define SHMORDER 4  // largest index of a struct shm: 2^SHMORDER pages
+
+struct shm {
+  int ref;               // regions using it
+  int npage;
+  uint64 *pages;         // each page's physical address, or 0
+};
+
+static struct spinlock shmlock;      // protects all struct shm
+static struct kmem_cache *shmcache;  // for struct shm
+
+void
+mmapinit(void)
+{
+  initlock(&shmlock, "shm");
+  shmcache = kmem_cache_create("shm", sizeof(struct shm));
+}
+
+// Make an empty struct shm of npage pages, or return 0.
+static struct shm*
+shmalloc(uint64 npage)
+{
+  struct shm *s;
+  int order = 0;
+
+  while(order <= SHMORDER && (PGSIZE << order) / sizeof(uint64) < npage)
+    order++;
+  if(order > SHMORDER || (s = kmem_cache_alloc(shmcache)) == 0)
+    return 0;
+  if((s->pages = kalloc_order(order)) == 0){
+    kmem_cache_free(shmcache, s);
+    return 0;
+  }
+  memset(s->pages, 0, PGSIZE << order);
+  s->ref = 1;
+  s->npage = npage;
+  return s;
+}
+
+static void
+shmdup(struct shm *s)
+{
+  acquire(&shmlock);
+  s->ref++;
+  release(&shmlock);
+}
+
+// Drop a reference to s, freeing it and its pages with
+// the last one. Processes mapping the pages hold their
+// own references to them.
+static void
+shmput(struct shm *s)
+{
+  int order = 0;
+
+  acquire(&shmlock);
+  if(--s->ref > 0){
+    release(&shmlock);
+    return;
+  }
+  release(&shmlock);
+  for(int i = 0; i < s->npage; i++)
+    if(s->pages[i])
+      kfree((void*)s->pages[i]);
+  while((PGSIZE << order) / sizeof(uint64) < s->npage)
+    order++;
+  kfree_order(s->pages, order);
+  kmem_cache_free(shmcache, s);
+}
+
+// The physical address of page i of s, allocating it if
+// this is the first touch, with a reference added for the
+// caller to map. Returns 0 if out of memory.
+static uint64
+shmpage(struct shm *s, int i)
+{
+  char *mem = 0;
+  uint64 pa;
+
+  if(s->pages[i] == 0 && (mem = kzalloc()) == 0)
+    return 0;
+  acquire(&shmlock);
+  if(s->pages[i] == 0){
+    s->pages[i] = (uint64)mem;
+    mem = 0;
+  }
+  pa = s->pages[i];
+  kref((void*)pa);
+  release(&shmlock);
+  if(mem)
+    kfree(mem);  // someone else got there first
+  return pa;
+}
+
+// A region of p overlapping [va, va+len), or 0.
+struct vma*
+vmalookup(struct proc *p, uint64 va, uint64 len)
+{
+  struct vma *v;
+
+  for(v = p->vm->vma; v < &p->vm->vma[NVMA]; v++)
+    if(v->len && va < v->addr + v->len && va + len > v->addr)
+      return v;
+  return 0;
+}
+
+// Lowest address of any mmap()ed region of p; the heap must
+// stay below it. Caller must hold p->vm->lock.
+uint64
+mmapbase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = THREADFRAME(NTHREAD-1);
+
+  for(v = p->vm->vma; v < &p->vm->vma[NVMA]; v++)
+    if(v->len && v->addr >= p->vm->sz && v->addr < base)
+      base = v->addr;
+  return base;
+}
+
+// Map len bytes of f, starting at file offset off, into the
+// current process, or len bytes of zeroed memory if flags
+// has MAP_ANONYMOUS, when f and off are ignored.
+// Returns the address, or -1.
+uint64
+mmap(uint64 len, int prot, int flags, struct file *f, uint64 off)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  struct shm *shm = 0;
+  uint64 base;
+  int anon = flags & MAP_ANONYMOUS;
+
+  flags &= ~MAP_ANONYMOUS;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if(anon){
+    f = 0;
+    off = 0;
+  } else {
+    if(f == 0 || off % PGSIZE != 0 || f->type != FD_INODE)
+      return -1;
+    // every mapping reads the file; only a shared writable
+    // one writes it.
+    if(!f->readable)
+      return -1;
+    if(flags == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+  if(len == 0)
+    return -1;
+  len = PGROUNDUP(len);
+  if(anon && flags == MAP_SHARED && (shm = shmalloc(len / PGSIZE)) == 0)
+    return -1;
+
+  acquire(&p->vm->lock);
+  for(v = p->vm->vma; v < &p->vm->vma[NVMA]; v++)
+    if(v->len == 0)
+      goto found;
+  goto bad;
+
+found:
+  base = mmapbase(p);
+  if(len > base || base - len < PGROUNDUP(p->vm->sz))
+    goto bad;
+  v->addr = base - len;
+  v->len = len;
+  v->prot = prot;
+  v->flags = flags;
+  v->ip = f ? idup(f->ip) : 0;
+  v->shm = shm;
+  v->off = off;
+  v->filesz = f ? len : 0;  // readi() stops at the end of the file
+  base = v->addr;
+  release(&p->vm->lock);
+  return base;
+
+ bad:
+  release(&p->vm->lock);
+  if(shm)
+    shmput(shm);
+  return -1;
+}
+
+// Write the dirty pages of v in [addr, addr+len) back to its
+// file, a few blocks per transaction as filewrite() does.
+// A mapping never makes the file longer.
+static void
+vmawriteback(struct proc *p, struct vma *v, uint64 addr, uint64 len)
+{
+  struct inode *ip = v->ip;
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  uint64 a, pa;
+  uint off, n;
+  pte_t *pte;
+
+  for(a = addr; a < addr + len; a += PGSIZE){
+    acquire(&p->vm->lock);
+    pte = walk(p->pagetable, a, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_D) == 0){
+      release(&p->vm->lock);
+      continue;
+    }
+    // another thread may unmap the page meanwhile.
+    pa = PTE2PA(*pte);
+    kref((void*)pa);
+    release(&p->vm->lock);
+    for(off = 0; off < PGSIZE; off += max){
+      begin_op();
+      ilock(ip);
+      n = v->off + (a - v->addr) + off;
+      n = n < ip->size ? ip->size - n : 0;
+      if(n > max)
+        n = max;
+      if(n > PGSIZE - off)
+        n = PGSIZE - off;
+      if(n > 0)
+        writei(ip, 0, pa + off, v->off + (a - v->addr) + off, n);
+      iunlock(ip);
+      end_op();
+    }
+    kfree((void*)pa);
+  }
+}
+
+// Remove [addr, addr+len) from the start or end of v.
+// The region shrinks before its pages go, so that another
+// thread can't fault them back in.
+static void
+vmaunmap(struct proc *p, struct vma *v, uint64 addr, uint64 len)
+{
+  struct inode *ip = 0;
+  struct shm *shm = 0;
+
+  if(v->ip && v->flags == MAP_SHARED && (v->prot & PROT_WRITE))
+    vmawriteback(p, v, addr, len);
+  acquire(&p->vm->lock);
+  if(addr == v->addr){
+    v->addr += len;
+    v->off += len;
+  }
+  v->len -= len;
+  if(v->len == 0){
+    ip = v->ip;
+    shm = v->shm;
+    v->ip = 0;
+    v->shm = 0;
+  }
+  if(p->vm->ref > 1){
+    release(&p->vm->lock);
+    uvmunmapthreads(p, addr, len / PGSIZE);
+  } else {
+    uvmunmap(p->pagetable, addr, len / PGSIZE, 1);
+    release(&p->vm->lock);
+  }
+  if(ip){
+    begin_op();
+    iput(ip);
+    end_op();
+  }
+  if(shm)
+    shmput(shm);
+}
+
+// Unmap [addr, addr+len) from the current process. The range
+// must be at the start or end of a single mapped region.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+
+  if(addr % PGSIZE != 0 || len == 0)
+    return -1;
+  len = PGROUNDUP(len);
+  acquire(&p->vm->lock);
+  if((v = vmalookup(p, addr, 1)) == 0 || len > v->addr + v->len - addr ||
+     (addr != v->addr && addr + len != v->addr + v->len)){
+    release(&p->vm->lock);
+    return -1;
+  }
+  release(&p->vm->lock);
+  vmaunmap(p, v, addr, len);
+  return 0;
+}
+
+// Unmap all of p's regions, for exit() and exec().
+void
+mmapexit(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vm->vma; v < &p->vm->vma[NVMA]; v++)
+    if(v->len)
+      vmaunmap(p, v, v->addr, v->len);
+}
+
+// Give child np the regions of p and their pages. The
+// program's regions lie below p->vm->sz, and uvmcopy() has
+// already copied their pages. If p has other threads,
+// MAP_PRIVATE pages are copied, as by uvmdup().
+// Returns 0 on success, -1 if out of memory.
+// np->lock and p->vm->lock are held, so nothing here
+// may sleep.
+int
+mmapcopy(struct proc *p, struct proc *np)
+{
+  struct vma *v, *nv;
+  int r;
+
+  for(v = p->vm->vma, nv = np->vm->vma; v < &p->vm->vma[NVMA]; v++, nv++){
+    if(v->len == 0)
+      continue;
+    if(v->addr < p->vm->sz)
+      r = 0;
+    else if(v->flags == MAP_PRIVATE && p->vm->ref > 1)
+      r = uvmdup(p->pagetable, np->pagetable, v->addr, v->len);
+    else
+      r = uvmshare(p->pagetable, np->pagetable, v->addr, v->len,
+                   v->flags == MAP_PRIVATE);
+    if(r < 0)
+      goto err;
+    *nv = *v;
+  }
+  for(nv = np->vm->vma; nv < &np->vm->vma[NVMA]; nv++){
+    if(nv->len && nv->ip)
+      idup(nv->ip);
+    if(nv->len && nv->shm)
+      shmdup(nv->shm);
+  }
+  return 0;
+
+ err:
+  for(nv = np->vm->vma; nv < &np->vm->vma[NVMA]; nv++){
+    if(nv->len && nv->addr >= p->vm->sz)
+      uvmunmap(np->pagetable, nv->addr, nv->len / PGSIZE, 1);
+    nv->len = 0;
+  }
+  return -1;
+}
+
+// Map the page of a region that holds va: the shared page
+// of anonymous shared memory, the page cache's copy if the
+// region is read-only and the page all comes from the file,
+// else a private page, read from the file as far as
+// v->filesz and zero beyond.
+// Returns 0 on success, -1 if va isn't in a region that
+// allows the access, or memory is exhausted.
+int
+mmapfault(struct proc *p, uint64 va, int write)
+{
+  struct vma *v, vv;
+  uint64 pa = 0, off;
+  char *mem;
+  pte_t *pte;
+  int perm, nolock, r = -1;
+
+  // reading the file sleeps, which a caller holding a
+  // spinlock must not do; see mmapprefault().
+  push_off();
+  nolock = mycpu()->noff == 1;
+  pop_off();
+
+  // another thread may unmap the region while the page is
+  // read, so work from a copy of it, holding references to
+  // its inode and shared memory.
+  acquire(&p->vm->lock);
+  if((v = vmalookup(p, va, 1)) == 0 || (v->prot & (PROT_READ|PROT_WRITE)) == 0 ||
+     (write && (v->prot & PROT_WRITE) == 0) || (v->ip && !nolock)){
+    release(&p->vm->lock);
+    return -1;
+  }
+  vv = *v;
+  if(vv.ip)
+    idup(vv.ip);
+  if(vv.shm)
+    shmdup(vv.shm);
+  release(&p->vm->lock);
+
+  va = PGROUNDDOWN(va);
+  off = va - vv.addr;
+  if(vv.shm){
+    pa = shmpage(vv.shm, (vv.off + off) / PGSIZE);
+  } else if(vv.ip == 0){
+    pa = (uint64)kzalloc();
+  } else {
+    ilock(vv.ip);
+    if((vv.prot & PROT_WRITE) == 0 && off + PGSIZE <= vv.filesz){
+      pa = pcacheget(vv.ip, vv.off + off);
+    } else if((mem = kzalloc()) != 0){
+      if(off < vv.filesz)
+        readi(vv.ip, 0, (uint64)mem, vv.off + off,
+              vv.filesz - off < PGSIZE ? vv.filesz - off : PGSIZE);
+      pa = (uint64)mem;
+    }
+    iunlock(vv.ip);
+  }
+  if(pa == 0)
+    goto out;
+
+  // a writable page must be readable too.
+  perm = PTE_U | PTE_R;
+  if(vv.prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(vv.prot & PROT_EXEC)
+    perm |= PTE_X;
+  // another thread may have mapped the page, or unmapped
+  // the region, while the file was read.
+  acquire(&p->vm->lock);
+  pte = walk(p->pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    r = 0;
+  } else if(vmalookup(p, va, 1) == v && v->ip == vv.ip && v->shm == vv.shm &&
+            mappages(p->pagetable, va, PGSIZE, pa, perm) == 0){
+    pa = 0;
+    r = 0;
+  }
+  release(&p->vm->lock);
+  if(pa)
+    kfree((void*)pa);
+
+out:
+  if(vv.ip){
+    begin_op();
+    iput(vv.ip);
+    end_op();
+  }
+  if(vv.shm)
+    shmput(vv.shm);
+  return r;
+}
+
+// Fault in the region pages of the current process in
+// [va, va+len), for read() and write(), which copy to and
+// from user memory while holding pipe, console and inode
+// locks.
+void
+mmapprefault(uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 a;
+
+  for(v = p->vm->vma; v < &p->vm->vma[NVMA]; v++){
+    if(v->len == 0 || va >= v->addr + v->len || va + len <= v->addr)
+      continue;
+    a = va > v->addr ? PGROUNDDOWN(va) : v->addr;
+    for(; a < va + len && a < v->addr + v->len; a += PGSIZE)
+      walkaddr(p->pagetable, a);
+  }
+}
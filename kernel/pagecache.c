@@ -0,0 +1,190 @@
+// Page cache for the read-only parts of programs.
+//
+// exec() maps read-only segments from here rather than
+// reading them into fresh pages, so every process running a
+// program shares one copy of its text. A cached page holds
+// file bytes [off, off+PGSIZE) of an inode, zero past the
+// end of the file, and is keyed by (dev, inum, off).
+//
+// The cache keeps one reference to each of its pages and
+// each mapping holds another, so a page outlives the
+// processes that map it and is ready for the next exec().
+// Writing or truncating the inode drops its cached pages;
+// processes already mapping them keep the old contents.
+// pcachereap() gives pages that only the cache is using
+// back to kalloc() when memory runs out.
+//
+// Pages of one inode live in one bucket. Fills and
+// invalidations of an inode happen with the inode locked,
+// so they never race with each other.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "defs.h"
+
+#define NPCBUCKET 31
+
+struct cpage {
+  uint dev;
+  uint inum;
+  uint off;              // file offset of the page's first byte
+  uint64 pa;
+  struct cpage *next;    // in bucket
+};
+
+struct pcbucket {
+  struct spinlock lock;
+  struct cpage *head;
+};
+
+static struct {
+  struct kmem_cache *cache;  // for struct cpage
+  struct pcbucket bucket[NPCBUCKET];
+  int npage;
+  uint64 nhit;
+  uint64 nmiss;
+} pcache;
+
+static struct pcbucket*
+pcbucket(uint dev, uint inum)
+{
+  return &pcache.bucket[(dev * 7 + inum) % NPCBUCKET];
+}
+
+void
+pcacheinit(void)
+{
+  for(int i = 0; i < NPCBUCKET; i++)
+    initlock(&pcache.bucket[i].lock, "pcache");
+  pcache.cache = kmem_cache_create("pcache", sizeof(struct cpage));
+}
+
+// Return the physical address of the cached page holding
+// ip's bytes [off, off+PGSIZE), reading it in if need be,
+// with a reference added for the caller to kfree().
+// Returns 0 if out of memory.
+// Caller must hold ip->lock.
+uint64
+pcacheget(struct inode *ip, uint off)
+{
+  struct pcbucket *b = pcbucket(ip->dev, ip->inum);
+  struct cpage *c;
+  char *mem;
+
+  acquire(&b->lock);
+  for(c = b->head; c; c = c->next){
+    if(c->dev == ip->dev && c->inum == ip->inum && c->off == off){
+      kref((void*)c->pa);
+      release(&b->lock);
+      __sync_fetch_and_add(&pcache.nhit, 1);
+      return c->pa;
+    }
+  }
+  release(&b->lock);
+
+  // allocate before taking the bucket lock, since kalloc()
+  // may call pcachereap().
+  if((c = kmem_cache_alloc(pcache.cache)) == 0)
+    return 0;
+  if((mem = kzalloc()) == 0){
+    kmem_cache_free(pcache.cache, c);
+    return 0;
+  }
+  readi(ip, 0, (uint64)mem, off, PGSIZE);
+  kref(mem);
+  c->dev = ip->dev;
+  c->inum = ip->inum;
+  c->off = off;
+  c->pa = (uint64)mem;
+
+  acquire(&b->lock);
+  c->next = b->head;
+  b->head = c;
+  release(&b->lock);
+  __sync_fetch_and_add(&pcache.npage, 1);
+  __sync_fetch_and_add(&pcache.nmiss, 1);
+  return c->pa;
+}
+
+// Drop the cached pages in bucket b that match, for which
+// keep() returns 0. Returns the number dropped.
+static int
+pcachedrop(struct pcbucket *b, int (*keep)(struct cpage*, struct inode*),
+           struct inode *ip)
+{
+  struct cpage *c, **pp, *dead = 0;
+  int n = 0;
+
+  acquire(&b->lock);
+  for(pp = &b->head; (c = *pp) != 0; ){
+    if(keep(c, ip)){
+      pp = &c->next;
+      continue;
+    }
+    *pp = c->next;
+    c->next = dead;
+    dead = c;
+    n++;
+  }
+  release(&b->lock);
+
+  while(dead){
+    c = dead;
+    dead = c->next;
+    kfree((void*)c->pa);
+    kmem_cache_free(pcache.cache, c);
+  }
+  __sync_fetch_and_sub(&pcache.npage, n);
+  return n;
+}
+
+static int
+otherinode(struct cpage *c, struct inode *ip)
+{
+  return c->dev != ip->dev || c->inum != ip->inum;
+}
+
+static int
+mapped(struct cpage *c, struct inode *ip)
+{
+  return krefcnt((void*)c->pa) > 1;
+}
+
+// ip's contents are changing; forget its cached pages.
+// Caller must hold ip->lock.
+void
+pcacheinval(struct inode *ip)
+{
+  struct pcbucket *b = pcbucket(ip->dev, ip->inum);
+
+  if(b->head)
+    pcachedrop(b, otherinode, ip);
+}
+
+// Free cached pages that no process maps. Called by
+// kalloc() when it runs out of memory.
+// Returns the number of pages freed.
+int
+pcachereap(void)
+{
+  int n = 0;
+
+  for(int i = 0; i < NPCBUCKET; i++)
+    if(pcache.bucket[i].head)
+      n += pcachedrop(&pcache.bucket[i], mapped, 0);
+  return n;
+}
+
+// Print cache size and hit rate, for the kstats system call.
+void
+pcachestats(void)
+{
+  printf("pcache: %d pages, %ld hits, %ld misses\n",
+         pcache.npage, pcache.nhit, pcache.nmiss);
+}
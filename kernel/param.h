@@ -10,4 +10,14 @@
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       1000  // size of file system in blocks
+#define SWAPBLOCKS   16384 // size of swap area in blocks, after the file system
 #define MAXPATH      128   // maximum file path name
+#define MAXORDER     10    // largest buddy block is 2^MAXORDER pages
+#define NVMA         16    // mapped regions per process
+#define NTHREAD      16    // threads per process
+#define NFUTEX       64    // futex wait-queue hash buckets
+#define NWAITQ       64    // sleep() wait-queue hash buckets
+#define NPRIO        4     // scheduling priority levels
+#define BOOSTTICKS   100   // ticks between priority boosts
+#define TIMERHZ      10000000  // timer cycles per second in qemu
+#define TICKCYCLES   (TIMERHZ/10)  // timer cycles per tick
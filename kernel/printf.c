@@ -26,11 +26,11 @@ static struct {
 static char digits[] = "0123456789abcdef";
 
 static void
-printint(int xx, int base, int sign)
+printint(long xx, int base, int sign)
 {
-  char buf[16];
+  char buf[24];
   int i;
-  uint x;
+  uint64 x;
 
   if(sign && (sign = xx < 0))
     x = -xx;
@@ -59,13 +59,15 @@ printptr(uint64 x)
     consputc(digits[x >> (sizeof(uint64) * 8 - 4)]);
 }
 
-// Print to the console. only understands %d, %x, %p, %s.
+// Print to the console. only understands %d, %u, %x, %p, %s,
+// and %ld, %lu, %lx for 64-bit values.
 void
 printf(char *fmt, ...)
 {
   va_list ap;
   int i, c, locking;
   char *s;
+  int l;
 
   locking = pr.locking;
   if(locking)
@@ -81,14 +83,19 @@ printf(char *fmt, ...)
       continue;
     }
     c = fmt[++i] & 0xff;
+    if((l = c == 'l') != 0)
+      c = fmt[++i] & 0xff;
     if(c == 0)
       break;
     switch(c){
     case 'd':
-      printint(va_arg(ap, int), 10, 1);
+      printint(l ? va_arg(ap, long) : va_arg(ap, int), 10, 1);
+      break;
+    case 'u':
+      printint(l ? va_arg(ap, uint64) : va_arg(ap, uint), 10, 0);
       break;
     case 'x':
-      printint(va_arg(ap, int), 16, 1);
+      printint(l ? va_arg(ap, uint64) : va_arg(ap, int), 16, l == 0);
       break;
     case 'p':
       printptr(va_arg(ap, uint64));
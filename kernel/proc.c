@@ -10,6 +10,10 @@ struct cpu cpus[NCPU];
 
 struct proc proc[NPROC];
 
+struct vmspace vmspace[NPROC];
+
+struct files files[NPROC];
+
 struct proc *initproc;
 
 int nextpid = 1;
@@ -21,13 +25,117 @@ static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
+extern pagetable_t kernel_pagetable; // vm.c
+
+// ASIDs tag TLB entries with the page table they came from,
+// so that switching page tables need not flush the TLB.
+// A process has two, one for its user page table and one
+// for its kernel page table; kernel_pagetable uses ASID 0.
+// They are handed out in order as processes are scheduled.
+// When they run out a new generation begins: each hart
+// flushes its whole TLB before it next runs a process, and
+// each process takes new ASIDs when it next runs.
+struct {
+  struct spinlock lock;
+  int n;           // ASIDs the hardware has; 0 to not use them
+  int next;        // next free ASID
+  uint64 gen;      // current generation
+  uint64 nflush;   // per-ASID flushes when processes move between harts
+} asids;
+
+static void asidinit(void);
+
+// RUNNABLE processes wait in per-CPU FIFO queues, so that
+// the scheduler takes the next one without looking at the
+// rest of proc[], and without contending with other CPUs.
+// A process is on a queue exactly when it is RUNNABLE.
+// setrunnable() puts it back on the queue of the CPU it
+// last ran on, whose cache and TLB may still hold its
+// memory. A CPU with an empty queue steals from the
+// longest one. A CPU with nothing to steal either waits
+// in wfi with its ticks off (see timer.c), so setrunnable()
+// wakes it if it queues work there, or queues a second
+// process behind a busy CPU, which it could steal.
+//
+// Each queue is a multi-level feedback queue. A process
+// starts at priority 0, or lower if it is nice(), and is
+// demoted a level each time it uses up the time slice of
+// its level, which doubles at each level; see schedtick().
+// A process that sleeps before its slice is up keeps its
+// priority, so interactive programs stay ahead of ones
+// that compute. The scheduler runs the highest-priority
+// process queued, and every BOOSTTICKS ticks all processes
+// go back to their starting priority, so that none starve.
+// A process takes 1+2+4+8 = 15 ticks of its own to sink to
+// the lowest level, so with a few competing for a CPU a
+// shorter boost period would keep them all near the top.
+#define QUANTUM(prio) (1 << (prio))  // ticks
+#define NICEPRIO(nice) ((nice) * NPRIO / 20)
+
+struct {
+  uint64 nswtch;   // processes picked to run
+  uint64 time;     // r_time() spent picking them
+  uint64 nidle;    // times a CPU found nothing to do and waited
+  uint64 nsteal;   // processes taken from another CPU's queue
+  uint64 nmigrate; // processes run on a different CPU than last time
+  uint64 ndemote;  // time slices used up
+  uint64 boostgen; // priority boosts so far
+} schedstat;
+
+// Threads and processes sharing memory block in
+// futex_wait() until another calls futex_wake() on the same
+// word. Waiters are keyed by the word's physical address,
+// so processes sharing it through mmap() find each other,
+// and queued by that address in a hash table.
+struct {
+  struct spinlock lock;
+  struct proc *head;  // waiters, newest first
+} futexq[NFUTEX];
+
+#define FUTEXHASH(pa) (((pa) >> 2) % NFUTEX)
+
+// Sleeping processes wait in a hash table of queues, keyed
+// by channel, so that wakeup() looks only at processes
+// sleeping on channels in the same bucket, not at all of
+// proc[]. A process joins its queue in sleep() and leaves
+// it there once woken, whoever woke it.
+struct waitq {
+  struct spinlock lock;  // taken last: no lock is acquired while it is held
+  struct proc *head;
+} waitq[NWAITQ];
+
+#define WAITQ(chan) (&waitq[(((uint64)(chan) >> 3) ^ ((uint64)(chan) >> 11)) % NWAITQ])
+#define WAKEBATCH 8  // sleepers wakeup() gathers at a time
+
+uint64 wakeseq;  // numbers wakeup() calls
+
+struct {
+  uint64 ncall;    // calls to wakeup()
+  uint64 nlock;    // p->locks it acquired
+  uint64 nwoken;   // processes it woke
+  uint64 time;     // r_time() spent in it
+} wakestat;
+
 // initialize the proc table at boot time.
 void
 procinit(void)
 {
   struct proc *p;
+  struct vmspace *vm;
   
   initlock(&pid_lock, "nextpid");
+  for(struct cpu *c = cpus; c < &cpus[NCPU]; c++){
+    initlock(&c->rq.lock, "runq");
+    initlock(&c->tq.lock, "timerq");
+  }
+  for(vm = vmspace; vm < &vmspace[NPROC]; vm++)
+    initlock(&vm->lock, "vmspace");
+  for(int i = 0; i < NPROC; i++)
+    initlock(&files[i].lock, "files");
+  for(int i = 0; i < NFUTEX; i++)
+    initlock(&futexq[i].lock, "futex");
+  for(int i = 0; i < NWAITQ; i++)
+    initlock(&waitq[i].lock, "waitq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
 
@@ -42,6 +150,340 @@ procinit(void)
       p->kstack = va;
   }
   kvminithart();
+  asidinit();
+}
+
+// Find out how many ASIDs the hardware implements, by
+// writing ones to satp's ASID field and reading it back.
+static void
+asidinit(void)
+{
+  initlock(&asids.lock, "asids");
+  w_satp(MAKE_SATP(kernel_pagetable) | SATP_ASIDMASK);
+  asids.n = ((r_satp() & SATP_ASIDMASK) >> 44) + 1;
+  kvminithart();
+  if(asids.n < 3)
+    asids.n = 0;  // not enough for even one process
+  asids.next = 1;
+  asids.gen = 1;
+}
+
+// Switch this hart to p's kernel page table, giving p new
+// ASIDs if its are from an old generation, and flushing
+// whatever TLB entries might be stale.
+// Caller must hold p->lock.
+static void
+asidswitch(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  uint64 gen;
+
+  if(asids.n == 0){
+    w_satp(MAKE_SATP(p->kpagetable));
+    sfence_vma();
+    return;
+  }
+
+  acquire(&asids.lock);
+  if(p->asidgen != asids.gen){
+    if(asids.next + 2 > asids.n){
+      asids.gen++;
+      asids.next = 1;
+    }
+    p->asid = asids.next;
+    p->asidgen = asids.gen;
+    p->asidcpu = -1;
+    asids.next += 2;
+  }
+  gen = asids.gen;
+  release(&asids.lock);
+
+  w_satp(MAKE_SATP_ASID(p->kpagetable, p->asid + 1));
+  if(c->asidgen != gen){
+    // entries of an old generation may be tagged with
+    // ASIDs that are now someone else's.
+    sfence_vma();
+    c->asidgen = gen;
+  } else if(p->asidcpu != cpuid()){
+    // p may have run here before, and changed its page
+    // tables elsewhere since.
+    sfence_vma_asid(p->asid);
+    sfence_vma_asid(p->asid + 1);
+    __sync_fetch_and_add(&asids.nflush, 1);
+  }
+  p->asidcpu = cpuid();
+}
+
+// Switch this hart back to kernel_pagetable, after running
+// a process.
+static void
+asidswitchback(void)
+{
+  if(asids.n == 0)
+    kvminithart();
+  else
+    w_satp(MAKE_SATP(kernel_pagetable));
+}
+
+// Flush this hart's TLB entries for user address va of
+// pagetable, or for all of its addresses if va is -1. If
+// pagetable is the current process's, only entries tagged
+// with its two ASIDs can be stale; for any other, which
+// ASIDs tag its entries isn't known, so flush them all.
+void
+asidflush(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+
+  if(asids.n == 0 || p == 0 || p->pagetable != pagetable){
+    if(va == -1)
+      sfence_vma();
+    else
+      sfence_vma_page(va);
+    return;
+  }
+  for(int asid = p->asid; asid <= p->asid + 1; asid++){
+    if(va == -1)
+      sfence_vma_asid(asid);
+    else
+      sfence_vma_page_asid(va, asid);
+  }
+}
+
+// Print ASID usage, for the kstats system call.
+void
+asidstats(void)
+{
+  printf("asid: %d ASIDs, generation %ld, %ld migration flushes\n",
+         asids.n, asids.gen, asids.nflush);
+}
+
+// Give p its starting priority back if there has been a
+// priority boost since it last had one.
+static void
+boostcheck(struct proc *p)
+{
+  if(p->boostgen != schedstat.boostgen){
+    p->boostgen = schedstat.boostgen;
+    p->prio = NICEPRIO(p->nice);
+    p->slice = 0;
+  }
+}
+
+// Make p RUNNABLE and queue it on the CPU it last ran on,
+// or on this CPU if it hasn't run yet.
+// Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct cpu *c, *v;
+  struct runq *rq;
+  int n;
+
+  if(!holding(&p->lock))
+    panic("setrunnable");
+  boostcheck(p);
+  p->state = RUNNABLE;
+  p->rqnext = 0;
+  c = &cpus[p->cpu >= 0 ? p->cpu : cpuid()];
+  rq = &c->rq;
+  acquire(&rq->lock);
+  if(rq->tail[p->prio])
+    rq->tail[p->prio]->rqnext = p;
+  else
+    rq->head[p->prio] = p;
+  rq->tail[p->prio] = p;
+  rq->mask |= 1 << p->prio;
+  n = ++rq->n;
+  release(&rq->lock);
+
+  // wake an idle CPU to run p. release() has ordered the
+  // queueing before reading idle; the scheduler sets idle
+  // before looking at the queues a last time.
+  if(c->idle){
+    timerkick(c);
+  } else if(n > 1){
+    for(v = cpus; v < &cpus[NCPU]; v++){
+      if(v->idle){
+        timerkick(v);
+        break;
+      }
+    }
+  }
+}
+
+// Take the first process of the highest priority queued
+// on rq, or return 0.
+static struct proc*
+runqpop(struct runq *rq)
+{
+  struct proc *p = 0;
+  int prio;
+
+  acquire(&rq->lock);
+  if(rq->mask){
+    prio = __builtin_ctz(rq->mask);
+    p = rq->head[prio];
+    rq->head[prio] = p->rqnext;
+    if(rq->head[prio] == 0){
+      rq->tail[prio] = 0;
+      rq->mask &= ~(1 << prio);
+    }
+    rq->n--;
+  }
+  release(&rq->lock);
+  return p;
+}
+
+// Move every process queued on rq to its starting
+// priority, for a priority boost.
+static void
+runqboost(struct runq *rq)
+{
+  struct proc *p, *all = 0, **tail = &all;
+  int prio;
+
+  acquire(&rq->lock);
+  for(prio = 0; prio < NPRIO; prio++){
+    *tail = rq->head[prio];
+    if(rq->head[prio])
+      tail = &rq->tail[prio]->rqnext;
+    rq->head[prio] = rq->tail[prio] = 0;
+  }
+  rq->mask = 0;
+  for(p = all; p; p = all){
+    all = p->rqnext;
+    p->rqnext = 0;
+    p->boostgen = schedstat.boostgen;
+    p->prio = NICEPRIO(p->nice);
+    p->slice = 0;
+    if(rq->tail[p->prio])
+      rq->tail[p->prio]->rqnext = p;
+    else
+      rq->head[p->prio] = p;
+    rq->tail[p->prio] = p;
+    rq->mask |= 1 << p->prio;
+  }
+  release(&rq->lock);
+}
+
+// Called by clockintr() every BOOSTTICKS ticks: boost all
+// processes back to their starting priority. Running and
+// sleeping ones notice the new generation in schedtick()
+// and setrunnable().
+void
+schedboost(void)
+{
+  __sync_fetch_and_add(&schedstat.boostgen, 1);
+  for(struct cpu *c = cpus; c < &cpus[NCPU]; c++)
+    runqboost(&c->rq);
+}
+
+// Charge the current process for a timer tick. Returns 1
+// if it should yield: it has used up its time slice, and
+// drops a priority level, or a process of higher priority
+// is waiting on this CPU. Also called, with no tick to
+// charge, when vmshootdown() asks it to yield at once.
+int
+schedtick(void)
+{
+  struct proc *p = myproc();
+  int r;
+
+  acquire(&p->lock);
+  boostcheck(p);
+  if(p->resched){
+    r = 1;  // the scheduler clears it
+  } else if(++p->slice >= QUANTUM(p->prio)){
+    if(p->prio < NPRIO-1)
+      p->prio++;
+    p->slice = 0;
+    __sync_fetch_and_add(&schedstat.ndemote, 1);
+    r = 1;
+  } else {
+    r = (mycpu()->rq.mask & ((1 << p->prio) - 1)) != 0;
+  }
+  release(&p->lock);
+  return r;
+}
+
+// Change the current process's niceness by inc, within 0
+// to 19, and return the new value. Its priority falls or
+// rises to match at once.
+int
+nice(int inc)
+{
+  struct proc *p = myproc();
+  int n;
+
+  acquire(&p->lock);
+  n = p->nice + inc;
+  if(n < 0)
+    n = 0;
+  if(n > 19)
+    n = 19;
+  p->nice = n;
+  p->prio = NICEPRIO(n);
+  p->slice = 0;
+  release(&p->lock);
+  return n;
+}
+
+// Pick a process for this CPU to run: the next on its own
+// queue, else one from the longest queue, or 0 if there is
+// none. Its state is RUNNABLE, and stays so, since only the
+// scheduler that takes it off a queue changes it; but it
+// may still be switching out on another CPU, which holds
+// its lock until it has.
+static struct proc*
+runqget(void)
+{
+  struct cpu *c = mycpu(), *v, *busiest;
+  struct proc *p;
+  uint64 t0 = r_time();
+
+  if((p = runqpop(&c->rq)) == 0){
+    // the lengths may be stale, so this is only a guess.
+    busiest = 0;
+    for(v = cpus; v < &cpus[NCPU]; v++)
+      if(v != c && v->rq.n > 0 && (busiest == 0 || v->rq.n > busiest->rq.n))
+        busiest = v;
+    if(busiest && (p = runqpop(&busiest->rq)) != 0)
+      __sync_fetch_and_add(&schedstat.nsteal, 1);
+  }
+  if(p){
+    __sync_fetch_and_add(&schedstat.nswtch, 1);
+    __sync_fetch_and_add(&schedstat.time, r_time() - t0);
+  }
+  return p;
+}
+
+// Whether this CPU should wait for work: its own queue is
+// empty, and no other CPU has more than one process queued
+// to steal. Otherwise setrunnable() would not wake it.
+static int
+runqidle(void)
+{
+  struct cpu *c = mycpu(), *v;
+
+  for(v = cpus; v < &cpus[NCPU]; v++)
+    if(v->rq.n > (v == c ? 0 : 1))
+      return 0;
+  return 1;
+}
+
+// Print scheduler statistics, for the kstats system call.
+void
+schedstats(void)
+{
+  printf("sched: %ld switches, %ld timer ticks per pick, %ld idle\n",
+         schedstat.nswtch, schedstat.nswtch ? schedstat.time / schedstat.nswtch : 0,
+         schedstat.nidle);
+  printf("sched: %ld stolen, %ld migrations\n", schedstat.nsteal, schedstat.nmigrate);
+  printf("sched: %ld slices used up, %ld boosts\n", schedstat.ndemote, schedstat.boostgen);
+  printf("wakeup: %ld calls in %d clock ticks, %ld proc locks, %ld woken, %ld timer ticks per call\n",
+         wakestat.ncall, ticks, wakestat.nlock, wakestat.nwoken,
+         wakestat.ncall ? wakestat.time / wakestat.ncall : 0);
 }
 
 // Must be called with interrupts disabled,
@@ -85,14 +527,186 @@ allocpid() {
   return pid;
 }
 
+// Give p new, empty user memory, with its trapframe at
+// TRAPFRAME. There is a vmspace for every proc, so one is
+// always free. Returns 0, or -1 if out of memory.
+static int
+vmnew(struct proc *p)
+{
+  struct vmspace *vm;
+
+  for(vm = vmspace; vm < &vmspace[NPROC]; vm++){
+    acquire(&vm->lock);
+    if(vm->ref == 0)
+      goto found;
+    release(&vm->lock);
+  }
+  panic("vmnew");
+
+found:
+  vm->ref = 1;
+  vm->slots = 1;
+  vm->sz = 0;
+  memset(vm->vma, 0, sizeof(vm->vma));
+  vm->leader = p;
+  release(&vm->lock);
+
+  p->vm = vm;
+  p->trapva = THREADFRAME(0);
+  if((p->pagetable = proc_pagetable(p)) == 0)
+    return -1;
+  return 0;
+}
+
+// Make p a thread sharing t's memory, with its trapframe
+// in a free THREADFRAME() slot of t's page table.
+// Returns 0, or -1 if t has NTHREAD threads or out of memory.
+static int
+vmjoin(struct proc *p, struct proc *t)
+{
+  struct vmspace *vm = t->vm;
+  int slot;
+
+  acquire(&vm->lock);
+  for(slot = 0; slot < NTHREAD; slot++)
+    if((vm->slots & (1 << slot)) == 0)
+      break;
+  if(slot == NTHREAD || mappages(t->pagetable, THREADFRAME(slot), PGSIZE,
+                                 (uint64)p->trapframe, PTE_R | PTE_W) < 0){
+    release(&vm->lock);
+    return -1;
+  }
+  vm->slots |= 1 << slot;
+  vm->ref++;
+  p->vm = vm;
+  p->pagetable = t->pagetable;
+  p->trapva = THREADFRAME(slot);
+  release(&vm->lock);
+  return 0;
+}
+
+// If other threads share p's memory, stop p using it and
+// return 1. Return 0, leaving it to the caller to free the
+// memory, if p is its only user.
+static int
+vmleave(struct proc *p)
+{
+  struct vmspace *vm = p->vm;
+
+  acquire(&vm->lock);
+  if(vm->ref == 1){
+    release(&vm->lock);
+    return 0;
+  }
+  uvmunmap(p->pagetable, p->trapva, 1, 0);
+  vm->slots &= ~(1 << ((TRAPFRAME - p->trapva) / PGSIZE));
+  vm->ref--;
+  if(p->kpagetable)
+    ukvmclear(p);
+  p->vm = 0;
+  p->pagetable = 0;
+  release(&vm->lock);
+  return 1;
+}
+
+// Give p an empty file table of its own, or, if t is not 0,
+// share t's. There is one for every proc, so one is always
+// free.
+static void
+filesjoin(struct proc *p, struct proc *t)
+{
+  struct files *fs;
+
+  if(t){
+    fs = t->files;
+    acquire(&fs->lock);
+    fs->ref++;
+    release(&fs->lock);
+    p->files = fs;
+    return;
+  }
+  for(fs = files; fs < &files[NPROC]; fs++){
+    acquire(&fs->lock);
+    if(fs->ref == 0)
+      goto found;
+    release(&fs->lock);
+  }
+  panic("filesjoin");
+
+found:
+  fs->ref = 1;
+  memset(fs->ofile, 0, sizeof(fs->ofile));
+  fs->cwd = 0;
+  release(&fs->lock);
+  p->files = fs;
+}
+
+// If other threads share p's file table, stop p using it
+// and return 1. Return 0, leaving it to the caller to
+// close the files and free the table, if p is its only
+// user.
+static int
+filesleave(struct proc *p)
+{
+  struct files *fs = p->files;
+
+  acquire(&fs->lock);
+  if(fs->ref == 1){
+    release(&fs->lock);
+    return 0;
+  }
+  fs->ref--;
+  p->files = 0;
+  release(&fs->lock);
+  return 1;
+}
+
+// Copy ofile[] and cwd into p's own file table, taking new
+// references to them.
+static void
+filescopy(struct proc *p, struct file **ofile, struct inode *cwd)
+{
+  for(int i = 0; i < NOFILE; i++)
+    if(ofile[i])
+      p->files->ofile[i] = filedup(ofile[i]);
+  p->files->cwd = idup(cwd);
+}
+
+// Close p's open files and put its current directory, if
+// no other thread shares them.
+static void
+filesclose(struct proc *p)
+{
+  struct files *fs = p->files;
+
+  if(filesleave(p))
+    return;
+  for(int fd = 0; fd < NOFILE; fd++){
+    if(fs->ofile[fd]){
+      struct file *f = fs->ofile[fd];
+      fileclose(f);
+      fs->ofile[fd] = 0;
+    }
+  }
+  if(fs->cwd){
+    begin_op();
+    iput(fs->cwd);
+    end_op();
+    fs->cwd = 0;
+  }
+}
+
 // Look in the process table for an UNUSED proc.
 // If found, initialize state required to run in the kernel,
-// and return with p->lock held.
+// and return with p->lock held. The new process has empty
+// user memory and no open files, or, if share is not 0, is
+// a thread sharing share's memory and files.
 // If there are no free procs, or a memory allocation fails, return 0.
 static struct proc*
-allocproc(void)
+allocproc(struct proc *share)
 {
   struct proc *p;
+  int r;
 
   for(p = proc; p < &proc[NPROC]; p++) {
     acquire(&p->lock);
@@ -106,6 +720,14 @@ allocproc(void)
 
 found:
   p->pid = allocpid();
+  p->asidgen = 0;  // takes ASIDs when it first runs
+  p->asidcpu = -1;
+  p->cpu = -1;
+  p->nice = 0;
+  p->prio = 0;
+  p->slice = 0;
+  p->resched = 0;
+  p->boostgen = schedstat.boostgen;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -113,9 +735,21 @@ found:
     return 0;
   }
 
-  // An empty user page table.
-  p->pagetable = proc_pagetable(p);
-  if(p->pagetable == 0){
+  // An empty user page table, or share's.
+  if(share)
+    r = vmjoin(p, share);
+  else
+    r = vmnew(p);
+  if(r < 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
+  filesjoin(p, share);
+
+  // A kernel page table that will also map its user memory.
+  p->kpagetable = ukvmcreate();
+  if(p->kpagetable == 0){
     freeproc(p);
     release(&p->lock);
     return 0;
@@ -136,14 +770,30 @@ found:
 static void
 freeproc(struct proc *p)
 {
+  if(p->vm && !vmleave(p)){
+    if(p->pagetable)
+      proc_freepagetable(p->pagetable, p->vm->sz);
+    acquire(&p->vm->lock);
+    p->vm->ref = 0;
+    release(&p->vm->lock);
+  }
+  p->vm = 0;
+  p->pagetable = 0;
+  // the caller closed the files if p was their only user.
+  if(p->files && !filesleave(p)){
+    acquire(&p->files->lock);
+    p->files->ref = 0;
+    release(&p->files->lock);
+  }
+  p->files = 0;
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
-  p->pagetable = 0;
-  p->sz = 0;
+  if(p->kpagetable)
+    ukvmfree(p->kpagetable);
+  p->kpagetable = 0;
   p->pid = 0;
+  p->thread = 0;
   p->parent = 0;
   p->name[0] = 0;
   p->chan = 0;
@@ -175,7 +825,7 @@ proc_pagetable(struct proc *p)
   }
 
   // map the trapframe just below TRAMPOLINE, for trampoline.S.
-  if(mappages(pagetable, TRAPFRAME, PGSIZE,
+  if(mappages(pagetable, p->trapva, PGSIZE,
               (uint64)(p->trapframe), PTE_R | PTE_W) < 0){
     uvmunmap(pagetable, TRAMPOLINE, 1, 0);
     uvmfree(pagetable, 0);
@@ -191,7 +841,7 @@ void
 proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
-  uvmunmap(pagetable, TRAPFRAME, 1, 0);
+  uvmunmap(pagetable, THREADFRAME(NTHREAD-1), NTHREAD, 0);
   uvmfree(pagetable, sz);
 }
 
@@ -213,44 +863,72 @@ userinit(void)
 {
   struct proc *p;
 
-  p = allocproc();
+  p = allocproc(0);
   initproc = p;
   
   // allocate one user page and copy init's instructions
   // and data into it.
   uvminit(p->pagetable, initcode, sizeof(initcode));
-  p->sz = PGSIZE;
+  p->vm->sz = PGSIZE;
 
   // prepare for the very first "return" from kernel to user.
   p->trapframe->epc = 0;      // user program counter
   p->trapframe->sp = PGSIZE;  // user stack pointer
 
   safestrcpy(p->name, "initcode", sizeof(p->name));
-  p->cwd = namei("/");
+  p->files->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
+// Growth only reserves the address range; vmfault()
+// allocates each page when it is first touched.
+// Sets *oldsz to the size before, which another thread
+// may have changed since the caller last looked.
 // Return 0 on success, -1 on failure.
 int
-growproc(int n)
+growproc(int n, uint64 *oldsz)
 {
-  uint sz;
+  uint64 sz, newsz;
   struct proc *p = myproc();
+  struct vmspace *vm = p->vm;
+  int shared;
 
-  sz = p->sz;
+  acquire(&vm->lock);
+  sz = vm->sz;
+  newsz = sz + n;
+  shared = vm->ref > 1;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
-      return -1;
-    }
+    if(newsz > mmapbase(p))
+      goto bad;
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    if(newsz > sz)
+      goto bad;
+    if(shared){
+      // the pages are freed below, once the other threads
+      // are done with them. split a megapage now, as
+      // uvmdealloc() would.
+      if(PGROUNDUP(newsz) % SUPERPGSIZE != 0 &&
+         uvmsplit(p->pagetable, PGROUNDUP(newsz)) < 0)
+        goto bad;
+    } else if(uvmdealloc(p->pagetable, sz, newsz) != newsz){
+      goto bad;
+    }
   }
-  p->sz = sz;
+  vm->sz = newsz;
+  release(&vm->lock);
+
+  if(shared && PGROUNDUP(newsz) < PGROUNDUP(sz))
+    uvmunmapthreads(p, PGROUNDUP(newsz), (PGROUNDUP(sz) - PGROUNDUP(newsz)) / PGSIZE);
+  *oldsz = sz;
   return 0;
+
+ bad:
+  release(&vm->lock);
+  return -1;
 }
 
 // Create a new process, copying the parent.
@@ -258,22 +936,34 @@ growproc(int n)
 int
 fork(void)
 {
-  int i, pid;
+  int pid, r;
   struct proc *np;
   struct proc *p = myproc();
+  int tries = 0;
 
+again:
   // Allocate process.
-  if((np = allocproc()) == 0){
+  if((np = allocproc(0)) == 0){
     return -1;
   }
 
-  // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
-    freeproc(np);
-    release(&np->lock);
-    return -1;
+  // Copy user memory from parent to child. Other threads
+  // may be using p's memory, and could keep writing to a
+  // page through a stale TLB entry after it became
+  // copy-on-write, so the child gets its own copies of
+  // their writable pages.
+  acquire(&p->vm->lock);
+  if(p->vm->ref > 1)
+    r = uvmdup(p->pagetable, np->pagetable, 0, p->vm->sz);
+  else
+    r = uvmcopy(p->pagetable, np->pagetable, p->vm->sz);
+  np->vm->sz = p->vm->sz;
+  if(r == 0)
+    r = mmapcopy(p, np);
+  release(&p->vm->lock);
+  if(r < 0){
+    goto bad;
   }
-  np->sz = p->sz;
 
   np->parent = p;
 
@@ -284,23 +974,132 @@ fork(void)
   np->trapframe->a0 = 0;
 
   // increment reference counts on open file descriptors.
-  for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
-  np->cwd = idup(p->cwd);
+  acquire(&p->files->lock);
+  filescopy(np, p->files->ofile, p->files->cwd);
+  release(&p->files->lock);
 
   safestrcpy(np->name, p->name, sizeof(p->name));
+  np->nice = p->nice;
+  np->prio = NICEPRIO(p->nice);
 
   pid = np->pid;
 
-  np->state = RUNNABLE;
+  setrunnable(np);
 
   release(&np->lock);
 
   return pid;
+
+bad:
+  freeproc(np);
+  release(&np->lock);
+  // copying the memory failed, and kalloc() can't swap
+  // while np->lock is held, so make room now and try again.
+  if(++tries < 8 && swapreclaim() > 0)
+    goto again;
+  return -1;
 }
 
-// Pass p's abandoned children to init.
+// Create a new process running the program at path,
+// without copying the caller's memory as fork() would.
+// ofile[] gives the child's open files, whose references
+// it takes over whether or not it succeeds; slots may be 0.
+// Returns the child's pid, or -1 if the program can't be
+// run or there is no memory.
+int
+spawn(char *path, char **argv, struct file **ofile)
+{
+  int pid, argc;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  if((np = allocproc(0)) == 0){
+    for(int i = 0; i < NOFILE; i++)
+      if(ofile[i])
+        fileclose(ofile[i]);
+    return -1;
+  }
+  // USED keeps the scheduler and swapreclaim() away
+  // from np while execproc() builds its memory, which
+  // may sleep, so np->lock can't be held.
+  np->state = USED;
+  release(&np->lock);
+
+  memset(np->trapframe, 0, sizeof(*np->trapframe));
+  memmove(np->files->ofile, ofile, sizeof(np->files->ofile));
+  acquire(&p->files->lock);
+  np->files->cwd = idup(p->files->cwd);
+  release(&p->files->lock);
+
+  if((argc = execproc(np, path, argv)) < 0){
+    filesclose(np);
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->trapframe->a0 = argc;
+  np->nice = p->nice;
+  np->prio = NICEPRIO(p->nice);
+
+  acquire(&np->lock);
+  np->parent = p;
+  pid = np->pid;
+  setrunnable(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+// Create a thread that shares the caller's memory and
+// starts at fn(arg) on the given stack; fn must exit()
+// rather than return. It also shares the caller's open
+// files and working directory.
+// Returns the thread's pid, or -1 if the caller already
+// has NTHREAD threads or there is no memory.
+int
+clone(uint64 fn, uint64 arg, uint64 stack)
+{
+  int pid;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  if((np = allocproc(p)) == 0)
+    return -1;
+  // uvmunshare() may sleep; see spawn().
+  np->state = USED;
+  release(&np->lock);
+
+  if(uvmunshare(p) < 0){
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->a0 = arg;
+  np->trapframe->sp = stack & ~15;
+  np->trapframe->ra = 0;
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+  np->nice = p->nice;
+  np->prio = NICEPRIO(p->nice);
+
+  acquire(&np->lock);
+  np->thread = 1;
+  np->parent = p;
+  pid = np->pid;
+  setrunnable(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+// Pass p's abandoned children to init, which reaps
+// abandoned threads as it would processes. They stay
+// threads of the process they share memory with.
 // Caller must hold p->lock.
 void
 reparent(struct proc *p)
@@ -326,9 +1125,30 @@ reparent(struct proc *p)
   }
 }
 
+// Kill the threads that share p's memory.
+static void
+killthreads(struct proc *p)
+{
+  struct proc *t;
+
+  for(t = proc; t < &proc[NPROC]; t++){
+    if(t == p)
+      continue;
+    acquire(&t->lock);
+    if(t->vm == p->vm){
+      t->killed = 1;
+      if(t->state == SLEEPING)
+        setrunnable(t);
+    }
+    release(&t->lock);
+  }
+}
+
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
-// until its parent calls wait().
+// until its parent calls wait(), or join() for a
+// thread. A process's first thread, its leader,
+// takes the others with it.
 void
 exit(int status)
 {
@@ -337,19 +1157,17 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd]){
-      struct file *f = p->ofile[fd];
-      fileclose(f);
-      p->ofile[fd] = 0;
-    }
-  }
+  if(p->vm->leader == p)
+    killthreads(p);
 
-  begin_op();
-  iput(p->cwd);
-  end_op();
-  p->cwd = 0;
+  // Write back and unmap mapped files, unless other
+  // threads are still using them.
+  if(!vmleave(p))
+    mmapexit(p);
+
+  // Close all open files, unless other threads are still
+  // using them.
+  filesclose(p);
 
   // we might re-parent a child to init. we can't be precise about
   // waking up init, since we can't acquire its lock once we've
@@ -392,13 +1210,18 @@ exit(int status)
   panic("zombie exit");
 }
 
-// Wait for a child process to exit and return its pid.
-// Return -1 if this process has no children.
-int
-wait(uint64 addr)
+// Wait for a child to exit, free it, and return its pid,
+// copying its exit status to addr if addr is not 0. Waits
+// for thread tid if tid is not 0, else for any child that
+// isn't a thread. init's wait() reaps threads too, since
+// those whose creator exited become its children.
+// Return -1 if there is no such child, or if addr is bad,
+// though the child is freed then all the same.
+static int
+reap(int tid, uint64 addr)
 {
   struct proc *np;
-  int havekids, pid;
+  int havekids, pid, xstate;
   struct proc *p = myproc();
 
   // hold p->lock for the whole time to avoid lost
@@ -416,19 +1239,23 @@ wait(uint64 addr)
         // np->parent can't change between the check and the acquire()
         // because only the parent changes it, and we're the parent.
         acquire(&np->lock);
+        if(tid ? np->pid != tid || !np->thread : np->thread && p != initproc){
+          release(&np->lock);
+          continue;
+        }
         havekids = 1;
         if(np->state == ZOMBIE){
-          // Found one.
+          // Found one. Copy out its status with no locks
+          // held, since the copy may fault in a page of a
+          // program's data or read it from swap.
           pid = np->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                  sizeof(np->xstate)) < 0) {
-            release(&np->lock);
-            release(&p->lock);
-            return -1;
-          }
+          xstate = np->xstate;
           freeproc(np);
           release(&np->lock);
           release(&p->lock);
+          if(addr != 0 && copyout(p->pagetable, addr, (char *)&xstate,
+                                  sizeof(xstate)) < 0)
+            return -1;
           return pid;
         }
         release(&np->lock);
@@ -446,6 +1273,156 @@ wait(uint64 addr)
   }
 }
 
+// Wait for a child process to exit and return its pid.
+// Return -1 if this process has no children.
+int
+wait(uint64 addr)
+{
+  return reap(0, addr);
+}
+
+// Wait for thread tid, which the caller created with
+// clone(), to exit, and return tid.
+// Return -1 if there is no such thread.
+int
+join(int tid, uint64 addr)
+{
+  if(tid <= 0)
+    return -1;
+  return reap(tid, addr);
+}
+
+// Sleep until futex_wake() on the int at user address
+// addr, if it still holds val. The word's page stays held
+// meanwhile, so that it can't be swapped out or freed and
+// the address change under the waiter.
+// Returns 0 when woken, -1 if *addr != val, addr is bad,
+// or the caller was killed.
+int
+futex_wait(uint64 addr, int val)
+{
+  struct proc *p = myproc(), **pp;
+  uint64 pg, pa;
+  int r = -1;
+
+  if(addr % sizeof(int) != 0 || (pg = uvmhold(p->pagetable, PGROUNDDOWN(addr), 0)) == 0)
+    return -1;
+  pa = pg + (addr % PGSIZE);
+
+  acquire(&futexq[FUTEXHASH(pa)].lock);
+  // a futex_wake() after the caller changed the word
+  // needs this lock, so the wakeup can't be missed.
+  if(__atomic_load_n((int*)pa, __ATOMIC_SEQ_CST) == val){
+    p->futex = pa;
+    p->futexnext = futexq[FUTEXHASH(pa)].head;
+    futexq[FUTEXHASH(pa)].head = p;
+    while(p->futex && !p->killed)
+      sleep(&p->futex, &futexq[FUTEXHASH(pa)].lock);
+    if(p->futex){
+      // killed; take p off the queue.
+      for(pp = &futexq[FUTEXHASH(pa)].head; *pp != p; pp = &(*pp)->futexnext)
+        ;
+      *pp = p->futexnext;
+      p->futex = 0;
+    } else {
+      r = 0;
+    }
+  }
+  release(&futexq[FUTEXHASH(pa)].lock);
+  kfree((void*)pg);
+  return r;
+}
+
+// Wake at most n of the processes waiting in futex_wait()
+// on the int at user address addr, oldest first.
+// Returns the number woken, or -1 if addr is bad.
+int
+futex_wake(uint64 addr, int n)
+{
+  struct proc *p = myproc(), **pp, **oldest;
+  uint64 pg, pa;
+  int woken = 0;
+
+  if(addr % sizeof(int) != 0 || (pg = uvmhold(p->pagetable, PGROUNDDOWN(addr), 0)) == 0)
+    return -1;
+  pa = pg + (addr % PGSIZE);
+
+  acquire(&futexq[FUTEXHASH(pa)].lock);
+  while(woken < n){
+    oldest = 0;
+    for(pp = &futexq[FUTEXHASH(pa)].head; *pp; pp = &(*pp)->futexnext)
+      if((*pp)->futex == pa)
+        oldest = pp;
+    if(oldest == 0)
+      break;
+    p = *oldest;
+    *oldest = p->futexnext;
+    p->futex = 0;
+    wakeup(&p->futex);
+    woken++;
+  }
+  release(&futexq[FUTEXHASH(pa)].lock);
+  kfree((void*)pg);
+  return woken;
+}
+
+// Make sure that no other thread sharing p's memory can
+// still reach pages just unmapped from it, so that they
+// can be freed. The mappings may linger in their kernel
+// page tables, which are cleared, and in the TLBs of the
+// CPUs running them, which there is no way to flush from
+// here; retiring their ASIDs and waiting until each has
+// left its CPU does instead. Those running are kicked to
+// make them yield, rather than wait for their time slices,
+// which at low priority last several ticks; resched stays
+// set until the scheduler sees them leave.
+void
+vmshootdown(struct proc *p)
+{
+  struct proc *t;
+  int running, cpu;
+
+  acquire(&p->vm->lock);
+  for(t = proc; t < &proc[NPROC]; t++)
+    if(t != p && t->vm == p->vm && t->kpagetable)
+      ukvmclear(t);
+  release(&p->vm->lock);
+
+  for(t = proc; t < &proc[NPROC]; t++){
+    if(t == p)
+      continue;
+    cpu = -1;
+    acquire(&t->lock);
+    if(t->vm == p->vm){
+      t->asidgen = 0;  // new ASIDs when it next runs
+      if(t->state == RUNNING){
+        t->resched = 1;
+        cpu = t->cpu;
+      }
+    }
+    release(&t->lock);
+    if(cpu >= 0)
+      timerkick(&cpus[cpu]);
+  }
+
+  for(t = proc; t < &proc[NPROC]; t++){
+    if(t == p)
+      continue;
+    for(;;){
+      acquire(&t->lock);
+      running = t->vm == p->vm && t->state == RUNNING && t->resched;
+      release(&t->lock);
+      if(!running)
+        break;
+      // it leaves at the kick's interrupt, once it has
+      // interrupts on.
+      acquire(&tickslock);
+      sleep(&ticks, &tickslock);
+      release(&tickslock);
+    }
+  }
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -464,29 +1441,50 @@ scheduler(void)
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
     
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-
-        found = 1;
+    if((p = runqget()) == 0){
+      if(kzeroidle() == 0){
+        // nothing to run and no pages left to pre-zero.
+        // wait for an interrupt, with ticks off.
+        c->idle = 1;
+        __sync_synchronize();
+        if(runqidle()){
+          __sync_fetch_and_add(&schedstat.nidle, 1);
+          timerset();
+          intr_on();
+          asm volatile("wfi");
+        }
       }
-      release(&p->lock);
+      continue;
     }
-    if(found == 0) {
-      intr_on();
-      asm volatile("wfi");
+    if(c->idle){
+      c->idle = 0;
+      timerset();
     }
+
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler");
+    if(p->cpu != cpuid()){
+      if(p->cpu >= 0)
+        __sync_fetch_and_add(&schedstat.nmigrate, 1);
+      p->cpu = cpuid();
+    }
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    c->proc = p;
+    // run on p's kernel page table, through which the
+    // kernel reaches p's user memory directly.
+    asidswitch(p);
+    swtch(&c->context, &p->context);
+    asidswitchback();
+    p->resched = 0;  // it has left this CPU; see vmshootdown()
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
@@ -523,7 +1521,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -554,7 +1552,15 @@ forkret(void)
 void
 sleep(void *chan, struct spinlock *lk)
 {
-  struct proc *p = myproc();
+  struct proc *p = myproc(), **pp;
+  struct waitq *q = WAITQ(chan);
+
+  // Join chan's wait queue while still holding lk, so
+  // that a wakeup() after lk is released finds p there.
+  acquire(&q->lock);
+  p->waitnext = q->head;
+  q->head = p;
+  release(&q->lock);
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
@@ -575,6 +1581,11 @@ sleep(void *chan, struct spinlock *lk)
 
   // Tidy up.
   p->chan = 0;
+  acquire(&q->lock);
+  for(pp = &q->head; *pp != p; pp = &(*pp)->waitnext)
+    ;
+  *pp = p->waitnext;
+  release(&q->lock);
 
   // Reacquire original lock.
   if(lk != &p->lock){
@@ -583,20 +1594,58 @@ sleep(void *chan, struct spinlock *lk)
   }
 }
 
+// Whether a process may be sleeping on chan. Only a guess,
+// since processes sleeping on other channels share its
+// queue, and one leaves the queue after waking.
+int
+sleeping(void *chan)
+{
+  return WAITQ(chan)->head != 0;
+}
+
 // Wake up all processes sleeping on chan.
 // Must be called without any p->lock.
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  struct proc *p, *sleepers[WAKEBATCH];
+  struct waitq *q = WAITQ(chan);
+  uint64 t0 = r_time(), seq;
+  int i, n, nlock = 0, woken = 0;
+
+  // the sleepers can't be locked while q->lock is held,
+  // but stay valid, since they are in proc[]. they are
+  // gathered a few at a time, to keep the kernel stack
+  // small; the queue may change between batches, so each
+  // is marked with this call's number as it is gathered.
+  seq = __sync_add_and_fetch(&wakeseq, 1);
+  do {
+    n = 0;
+    acquire(&q->lock);
+    for(p = q->head; p && n < WAKEBATCH; p = p->waitnext){
+      if(p->wakeseq != seq){
+        p->wakeseq = seq;
+        sleepers[n++] = p;
+      }
+    }
+    release(&q->lock);
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == SLEEPING && p->chan == chan) {
-      p->state = RUNNABLE;
+    for(i = 0; i < n; i++){
+      p = sleepers[i];
+      acquire(&p->lock);
+      if(p->state == SLEEPING && p->chan == chan) {
+        setrunnable(p);
+        woken++;
+      }
+      release(&p->lock);
     }
-    release(&p->lock);
-  }
+    nlock += n;
+  } while(n == WAKEBATCH);
+
+  __sync_fetch_and_add(&wakestat.ncall, 1);
+  __sync_fetch_and_add(&wakestat.nlock, nlock);
+  __sync_fetch_and_add(&wakestat.nwoken, woken);
+  __sync_fetch_and_add(&wakestat.time, r_time() - t0);
 }
 
 // Wake up p if it is sleeping in wait(); used by exit().
@@ -607,7 +1656,7 @@ wakeup1(struct proc *p)
   if(!holding(&p->lock))
     panic("wakeup1");
   if(p->chan == p && p->state == SLEEPING) {
-    p->state = RUNNABLE;
+    setrunnable(p);
   }
 }
 
@@ -625,7 +1674,7 @@ kill(int pid)
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
-        p->state = RUNNABLE;
+        setrunnable(p);
       }
       release(&p->lock);
       return 0;
@@ -673,6 +1722,7 @@ procdump(void)
 {
   static char *states[] = {
   [UNUSED]    "unused",
+  [USED]      "used  ",
   [SLEEPING]  "sleep ",
   [RUNNABLE]  "runble",
   [RUNNING]   "run   ",
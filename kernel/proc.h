@@ -19,11 +19,32 @@ struct context {
 };
 
 // Per-CPU state.
+// A CPU's queues of RUNNABLE processes, one per priority.
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  uint mask;                  // bit i set if head[i] != 0
+  int n;                      // processes queued
+};
+
+// Timers set by processes on a CPU, which its timer
+// interrupts expire; see timer.c.
+struct timerq {
+  struct spinlock lock;
+  struct timer *head;         // earliest first
+  uint64 nexttick;            // time of the CPU's next tick
+};
+
 struct cpu {
   struct proc *proc;          // The process running on this cpu, or null.
+  struct runq rq;             // Processes waiting to run here.
+  struct timerq tq;
+  int idle;                   // Waiting for work, with ticks off?
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asidgen;             // ASID generation the TLB was last flushed for
 };
 
 extern struct cpu cpus[NCPU];
@@ -80,7 +101,39 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
-enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
+// a region of the address space mapped from a file by mmap(),
+// or a program segment mapped by exec().
+struct vma {
+  uint64 addr;                 // start, page-aligned
+  uint64 len;                  // bytes, page-aligned; 0 if unused
+  int prot;                    // PROT_READ, PROT_WRITE, PROT_EXEC
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct inode *ip;            // 0 if MAP_ANONYMOUS
+  struct shm *shm;             // pages of anonymous MAP_SHARED memory
+  uint64 off;                  // file offset of addr
+  uint64 filesz;               // bytes from the file; the rest is zero
+};
+
+// A process's memory, which its threads share.
+struct vmspace {
+  struct spinlock lock;        // protects sz, vma[] and the page table from other threads
+  int ref;                     // threads using it; 0 if free
+  uint slots;                  // THREADFRAME() slots in use, a bit each
+  uint64 sz;                   // Size of process memory (bytes)
+  struct vma vma[NVMA];        // mapped regions
+  struct proc *leader;         // first thread; exit() kills the others with it
+};
+
+// A process's open files and current directory, which its
+// threads share.
+struct files {
+  struct spinlock lock;        // protects ofile[] and cwd from other threads
+  int ref;                     // threads using it; 0 if free
+  struct file *ofile[NOFILE];  // Open files
+  struct inode *cwd;           // Current directory
+};
+
+enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
 struct proc {
@@ -93,14 +146,36 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int asid;                    // ASID of pagetable; kpagetable's is asid+1
+  uint64 asidgen;              // Generation of asid, stale if not current
+  int asidcpu;                 // CPU that last used asid, or -1
+  int kpreempt;                // Preempted in the kernel; don't swap its pages
+  int noswap;                  // In read() or write(); don't swap its pages
+  struct proc *rqnext;         // Next in the run queue, while RUNNABLE
+  int cpu;                     // CPU it last ran on, or -1
+  int prio;                    // Priority, 0 highest; see schedtick()
+  int slice;                   // Ticks used at prio
+  int nice;                    // 0 to 19; higher runs at lower priority
+  uint64 boostgen;             // Priority boost it has had
+  int thread;                  // Made by clone(); join() reaps it, not wait()
+  int resched;                 // Yield at the next interrupt; see vmshootdown()
+
+  // the lock of chan's wait queue must be held when using these:
+  struct proc *waitnext;       // Next sleeper in the wait queue of chan's bucket
+  uint64 wakeseq;              // Last wakeup() call to look at it
+
+  // futex.lock of the futex's bucket must be held when using these:
+  uint64 futex;                // Physical address of the word waited on, or 0
+  struct proc *futexnext;      // Next waiter in the same bucket
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
-  uint64 sz;                   // Size of process memory (bytes)
-  pagetable_t pagetable;       // User page table
+  struct vmspace *vm;          // User memory, shared with p's threads
+  pagetable_t pagetable;       // User page table, the same for all p's threads
+  pagetable_t kpagetable;      // Kernel page table, also mapping user memory
   struct trapframe *trapframe; // data page for trampoline.S
+  uint64 trapva;               // where pagetable maps trapframe
   struct context context;      // swtch() here to run process
-  struct file *ofile[NOFILE];  // Open files
-  struct inode *cwd;           // Current directory
+  struct files *files;         // Open files and cwd, shared with p's threads
   char name[16];               // Process name (debugging)
 };
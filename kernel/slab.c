@@ -0,0 +1,289 @@
+// Slab allocator for small kernel objects.
+//
+// A kmem_cache hands out fixed-size objects carved from
+// slabs, each slab being one page from kalloc() with a
+// struct slab header at its start, so the slab that owns an
+// object is found by rounding the object's address down.
+//
+// Each CPU has a magazine of recently freed objects in front
+// of the cache, so most allocations and frees touch only the
+// local magazine. Magazines refill from and flush to the
+// slabs in batches of MAGSIZE/2 under the cache lock.
+// A slab whose objects are all free goes back to kalloc().
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NSLABCACHE 16  // max number of caches
+#define MAGSIZE 8      // objects per CPU magazine
+
+struct obj {
+  struct obj *next;
+};
+
+// per-CPU stash of free objects.
+struct magazine {
+  struct spinlock lock;
+  int n;
+  void *objs[MAGSIZE];
+  uint64 nhit;             // allocations served from objs
+};
+
+struct kmem_cache {
+  char *name;              // 0 if this slot is unused
+  struct spinlock lock;    // protects the slab lists below
+  uint size;               // object size, rounded up to 8
+  int perslab;             // objects per slab
+  struct slab *partial;    // slabs with free objects
+  int nslab;               // slabs allocated
+  int nalloc;              // objects out of the slabs
+  struct magazine mag[NCPU];
+};
+
+// header at the start of each slab page.
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;       // on cache->partial
+  struct slab *prev;
+  struct obj *freelist;    // free objects in this slab
+  int inuse;               // objects handed out
+};
+
+static struct {
+  struct spinlock lock;
+  struct kmem_cache cache[NSLABCACHE];
+} slabs;
+
+void
+slabinit(void)
+{
+  initlock(&slabs.lock, "slabs");
+}
+
+// Create a cache of objects of the given size.
+// name must be a constant string.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+
+  size = (size + 7) & ~7;
+  if(size < sizeof(struct obj) || size > (PGSIZE - sizeof(struct slab)) / 2)
+    panic("kmem_cache_create: size");
+
+  acquire(&slabs.lock);
+  for(c = slabs.cache; c < &slabs.cache[NSLABCACHE]; c++){
+    if(c->name == 0)
+      goto found;
+  }
+  panic("kmem_cache_create: no caches");
+
+found:
+  c->name = name;
+  release(&slabs.lock);
+
+  initlock(&c->lock, name);
+  for(int i = 0; i < NCPU; i++)
+    initlock(&c->mag[i].lock, name);
+  c->size = size;
+  c->perslab = (PGSIZE - sizeof(struct slab)) / size;
+  c->partial = 0;
+  return c;
+}
+
+static void
+slab_unlink(struct kmem_cache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+  s->next = s->prev = 0;
+}
+
+static void
+slab_link(struct kmem_cache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+}
+
+// Return obj to its slab. Returns the slab's page if it
+// became entirely free, for the caller to kfree() once
+// c->lock is released. Caller must hold c->lock.
+static struct slab*
+slab_put(struct kmem_cache *c, void *obj)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)obj);
+  struct obj *o = (struct obj*)obj;
+
+  if(s->cache != c)
+    panic("kmem_cache_free: wrong cache");
+  if(s->freelist == 0)
+    slab_link(c, s);     // was full
+  o->next = s->freelist;
+  s->freelist = o;
+  s->inuse--;
+  c->nalloc--;
+  if(s->inuse == 0){
+    slab_unlink(c, s);
+    c->nslab--;
+    return s;
+  }
+  return 0;
+}
+
+// Move up to n objects from the slabs into magazine m.
+// Caller must hold m->lock and c->lock.
+static void
+mag_refill(struct kmem_cache *c, struct magazine *m, int n)
+{
+  struct slab *s;
+  struct obj *o;
+
+  while(n > 0 && (s = c->partial) != 0){
+    o = s->freelist;
+    s->freelist = o->next;
+    s->inuse++;
+    c->nalloc++;
+    if(s->freelist == 0)
+      slab_unlink(c, s);  // now full
+    m->objs[m->n++] = o;
+    n--;
+  }
+}
+
+// Move n objects from magazine m back to their slabs, and
+// free any slabs that become empty.
+// Caller must hold m->lock but not c->lock.
+static void
+mag_flush(struct kmem_cache *c, struct magazine *m, int n)
+{
+  struct slab *s, *empty = 0;
+
+  acquire(&c->lock);
+  while(n > 0 && m->n > 0){
+    if((s = slab_put(c, m->objs[--m->n])) != 0){
+      s->next = empty;
+      empty = s;
+    }
+    n--;
+  }
+  release(&c->lock);
+
+  while(empty){
+    s = empty;
+    empty = s->next;
+    kfree(s);
+  }
+}
+
+// Allocate an object from cache c.
+// Returns 0 if memory cannot be allocated.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  struct slab *s;
+  struct obj *o;
+  void *obj;
+
+  for(;;){
+    push_off();
+    m = &c->mag[cpuid()];
+    acquire(&m->lock);
+    if(m->n == 0){
+      acquire(&c->lock);
+      mag_refill(c, m, MAGSIZE/2);
+      release(&c->lock);
+    }
+    obj = m->n > 0 ? m->objs[--m->n] : 0;
+    if(obj)
+      m->nhit++;
+    release(&m->lock);
+    pop_off();
+    if(obj)
+      return obj;
+
+    // no free objects anywhere; make a new slab.
+    if((s = (struct slab*)kalloc()) == 0)
+      return 0;
+    s->cache = c;
+    s->inuse = 0;
+    s->freelist = 0;
+    for(int i = c->perslab - 1; i >= 0; i--){
+      o = (struct obj*)((char*)s + sizeof(struct slab) + i*c->size);
+      o->next = s->freelist;
+      s->freelist = o;
+    }
+    acquire(&c->lock);
+    slab_link(c, s);
+    c->nslab++;
+    release(&c->lock);
+  }
+}
+
+// Free an object allocated from cache c.
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct magazine *m;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  if(m->n == MAGSIZE)
+    mag_flush(c, m, MAGSIZE/2);
+  m->objs[m->n++] = obj;
+  release(&m->lock);
+  pop_off();
+}
+
+// Flush every magazine of every cache back to the slabs,
+// giving empty slabs back to kalloc(). Called by kalloc()
+// when it runs out of memory.
+void
+kmem_cache_reap(void)
+{
+  struct kmem_cache *c;
+
+  for(c = slabs.cache; c < &slabs.cache[NSLABCACHE]; c++){
+    if(c->name == 0)
+      continue;
+    for(int i = 0; i < NCPU; i++){
+      if(c->mag[i].n == 0)
+        continue;
+      acquire(&c->mag[i].lock);
+      mag_flush(c, &c->mag[i], MAGSIZE);
+      release(&c->mag[i].lock);
+    }
+  }
+}
+
+// Print per-cache usage, for the kstats system call.
+void
+slabstats(void)
+{
+  struct kmem_cache *c;
+  uint64 nhit;
+
+  for(c = slabs.cache; c < &slabs.cache[NSLABCACHE]; c++){
+    if(c->name == 0)
+      continue;
+    nhit = 0;
+    for(int i = 0; i < NCPU; i++)
+      nhit += c->mag[i].nhit;
+    printf("slab %s: %d-byte objects, %d in use, %d slabs of %d, "
+           "%ld magazine hits\n",
+           c->name, c->size, c->nalloc, c->nslab, c->perslab, nhit);
+  }
+}
@@ -0,0 +1,381 @@
+// Swapping of user memory to disk.
+//
+// mkfs leaves SWAPBLOCKS blocks after the file system for
+// swap, divided into page-sized slots. When kalloc() or
+// fork() run out of memory they call swapreclaim(), which
+// moves a batch of user pages out to slots, choosing them
+// with a clock scan: a hand sweeps over every process's
+// pages, and a page whose PTE_A is set gets a second chance,
+// its PTE_A cleared, rather than being evicted.
+//
+// An evicted page's PTE has PTE_V clear and PTE_SWAP set,
+// keeps its other flags, and holds the slot number where the
+// physical page number was. vmfault() reads the page back in.
+// fork() shares a slot as it would share the page, with a
+// count per slot, and each sharer reads in its own copy.
+//
+// Only heap and stack pages are evicted: pages outside any
+// struct vma, mapped by a single process and not
+// copy-on-write, of a process with no other threads. The
+// scan splits megapages to get at them.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "defs.h"
+
+#define NSLOT (SWAPBLOCKS / (PGSIZE / BSIZE))
+#define SWAPBATCH 16    // pages swapreclaim() tries to free
+#define SWAPSCAN 4096   // pages swapreclaim() looks at, at most
+
+// slot numbers live in a swapped-out PTE's PPN field.
+#define SLOT2PTE(slot) PA2PTE((uint64)(slot) << PGSHIFT)
+#define PTE2SLOT(pte) (PTE2PA(pte) >> PGSHIFT)
+
+extern struct proc proc[NPROC];
+
+static struct {
+  struct spinlock lock;   // protects ref, nused, hint
+  uchar ref[NSLOT];       // PTEs naming each slot; 0 if free
+  int nslot;              // 0 until swapinit()
+  int nused;
+  int hint;               // where to look for a free slot
+  uint dev;
+  uint start;             // first block of the swap area
+
+  struct buf buf;         // disk transfers; buf.lock serializes them
+
+  struct sleeplock scan;  // one clock scan at a time
+  int hand;               // index in proc[] of the clock hand
+  uint64 handva;          // and address it points at
+
+  uint64 nout;            // pages written out
+  uint64 nin;             // pages read back in
+} swap;
+
+// Find the swap area, which mkfs puts after the file
+// system. Called by fsinit().
+void
+swapinit(int dev, struct superblock *sb)
+{
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swap.buf.lock, "swapbuf");
+  initsleeplock(&swap.scan, "swapscan");
+  swap.dev = dev;
+  swap.start = sb->swapstart;
+  swap.nslot = sb->nswap / (PGSIZE / BSIZE);
+  if(swap.nslot > NSLOT)
+    swap.nslot = NSLOT;
+}
+
+// Allocate a slot, or return -1 if swap is full.
+static int
+slotalloc(void)
+{
+  int slot = -1;
+
+  acquire(&swap.lock);
+  for(int i = 0; i < swap.nslot; i++){
+    int s = (swap.hint + i) % swap.nslot;
+    if(swap.ref[s] == 0){
+      swap.ref[s] = 1;
+      swap.nused++;
+      swap.hint = s + 1;
+      slot = s;
+      break;
+    }
+  }
+  release(&swap.lock);
+  return slot;
+}
+
+static void
+slotput(int slot)
+{
+  acquire(&swap.lock);
+  if(swap.ref[slot] == 0)
+    panic("slotput");
+  if(--swap.ref[slot] == 0)
+    swap.nused--;
+  release(&swap.lock);
+}
+
+// A swapped-out PTE is being copied, by fork().
+void
+swapdup(pte_t pte)
+{
+  acquire(&swap.lock);
+  swap.ref[PTE2SLOT(pte)]++;
+  release(&swap.lock);
+}
+
+// A swapped-out PTE is going away.
+void
+swapfree(pte_t pte)
+{
+  slotput(PTE2SLOT(pte));
+}
+
+// Write page pa to slot, or read it from slot.
+static void
+swapio(int slot, uint64 pa, int write)
+{
+  struct buf *b = &swap.buf;
+
+  acquiresleep(&b->lock);
+  for(int i = 0; i < PGSIZE / BSIZE; i++){
+    b->dev = swap.dev;
+    b->blockno = swap.start + slot * (PGSIZE / BSIZE) + i;
+    if(write)
+      memmove(b->data, (char*)pa + i*BSIZE, BSIZE);
+    virtio_disk_rw(b, write);
+    if(!write)
+      memmove((char*)pa + i*BSIZE, b->data, BSIZE);
+  }
+  releasesleep(&b->lock);
+}
+
+// Sleeping to do disk I/O is only allowed if the caller
+// holds no spinlocks.
+static int
+maysleep(void)
+{
+  int ok;
+
+  push_off();
+  ok = mycpu()->noff == 1;
+  pop_off();
+  return ok;
+}
+
+// Read the swapped-out page that *pte names back into
+// memory. pte belongs to the current process.
+// Returns 0 on success, -1 if out of memory or if the
+// caller holds a spinlock; see swapprefault().
+int
+swapin(pte_t *pte)
+{
+  int slot = PTE2SLOT(*pte);
+  char *mem;
+
+  if(!maysleep() || (mem = kalloc()) == 0)
+    return -1;
+  swapio(slot, (uint64)mem, 0);
+  *pte = PA2PTE(mem) | (PTE_FLAGS(*pte) & ~PTE_SWAP) | PTE_V;
+  slotput(slot);
+  __sync_fetch_and_add(&swap.nin, 1);
+  return 0;
+}
+
+// Keep the current process's pages in memory until
+// swapon(). read() and write() copy to and from user memory
+// while holding pipe and console locks, under which swapin()
+// can't run, and may sleep for a long time before they do;
+// so they call swapoff() and then swapprefault().
+void
+swapoff(void)
+{
+  struct proc *p = myproc();
+
+  acquire(&p->lock);
+  p->noswap = 1;
+  release(&p->lock);
+}
+
+void
+swapon(void)
+{
+  struct proc *p = myproc();
+
+  acquire(&p->lock);
+  p->noswap = 0;
+  release(&p->lock);
+}
+
+// Swap in the current process's pages in [va, va+len), for
+// read() and write(); see swapoff().
+void
+swapprefault(uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+
+  if(swap.nused == 0)
+    return;
+  for(uint64 a = PGROUNDDOWN(va); a < va + len && a < p->vm->sz; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(pte && (*pte & PTE_SWAP))
+      vmfault(p, a, 0);
+  }
+}
+
+// The first 4 KB page p maps at or above *va and below end,
+// skipping unused parts of the tree and splitting megapages
+// that p alone uses, unless p is the current process, which
+// may be in the middle of splitting one itself; see
+// uvmsplit(). Sets *va to its address.
+// Caller must hold p->lock.
+static pte_t*
+nextpage(struct proc *p, uint64 *va, uint64 end)
+{
+  pagetable_t pagetable = p->pagetable;
+  uint64 a = *va;
+  pte_t *pte;
+
+  while(a < end){
+    pte = &pagetable[PX(2, a)];
+    if((*pte & PTE_V) == 0 || PTE_LEAF(*pte)){
+      a = (a + LEVELSIZE(2)) & ~(LEVELSIZE(2) - 1);
+      continue;
+    }
+    pte = &((pagetable_t)PTE2PA(*pte))[PX(1, a)];
+    if((*pte & PTE_V) && PTE_LEAF(*pte) && (*pte & PTE_U) && p != myproc() &&
+       krefcnt((void*)PTE2PA(*pte)) == 1 && uvmsplit(pagetable, a) == 0){
+      // the kernel may reach it through p's kernel page table.
+      if(a < PLIC)
+        ukvmsync(p, a, 1);
+    }
+    if((*pte & PTE_V) == 0 || PTE_LEAF(*pte)){
+      a = (a + LEVELSIZE(1)) & ~(LEVELSIZE(1) - 1);
+      continue;
+    }
+    pte = &((pagetable_t)PTE2PA(*pte))[PX(0, a)];
+    if(*pte & PTE_V){
+      *va = a;
+      return pte;
+    }
+    a += PGSIZE;
+  }
+  *va = end;
+  return 0;
+}
+
+// Whether swapreclaim() may touch p's page tables. Another
+// CPU may be running p, p may have been preempted in the
+// kernel between finding a page and copying to it, or be in
+// read() or write(), or spawn() may still be building p's
+// memory. Memory that
+// threads share is left alone, since the others could be
+// running.
+// Caller must hold p->lock.
+static int
+swappable(struct proc *p)
+{
+  if(p->state == RUNNING && p != myproc())
+    return 0;
+  if(p->state != RUNNING && p->state != RUNNABLE && p->state != SLEEPING)
+    return 0;
+  return !p->kpreempt && !p->noswap && p->vm && p->vm->ref == 1;
+}
+
+// p's TLB entries for va may be stale. If p is not running,
+// giving it new ASIDs when it next runs forgets them all.
+// Caller must hold p->lock.
+static void
+swapflush(struct proc *p, uint64 va)
+{
+  if(p == myproc())
+    sfence_vma_page(va);
+  else
+    p->asidgen = 0;
+}
+
+// Write one page, mapped at va by p, out to swap.
+// Returns 1 if the page was freed.
+// Caller must hold p->lock; it is released and
+// reacquired while the page is written.
+static int
+evict(struct proc *p, uint64 va, pte_t *pte)
+{
+  pagetable_t pagetable = p->pagetable;
+  int pid = p->pid, slot, done = 0;
+  uint64 pa = PTE2PA(*pte);
+  pte_t old;
+
+  // a write while the page is being copied out sets PTE_D
+  // again, and any access sets PTE_A; either way the page
+  // is in use and stays.
+  *pte &= ~PTE_D;
+  swapflush(p, va);
+  old = *pte;
+  kref((void*)pa);
+  release(&p->lock);
+
+  slot = slotalloc();
+  if(slot >= 0)
+    swapio(slot, pa, 1);
+
+  acquire(&p->lock);
+  if(slot >= 0 && p->pid == pid && p->pagetable == pagetable && swappable(p) &&
+     (pte = walk(pagetable, va, 0)) != 0 && *pte == old){
+    *pte = SLOT2PTE(slot) | (PTE_FLAGS(old) & ~(PTE_V|PTE_A|PTE_D)) | PTE_SWAP;
+    swapflush(p, va);
+    kfree((void*)pa);  // p's reference
+    __sync_fetch_and_add(&swap.nout, 1);
+    done = 1;
+  } else if(slot >= 0){
+    slotput(slot);
+  }
+  kfree((void*)pa);  // ours
+  return done;
+}
+
+// Free some memory by swapping user pages out. Returns
+// the number of pages freed, 0 if the caller holds a
+// spinlock or swap is full.
+int
+swapreclaim(void)
+{
+  struct proc *p;
+  pte_t *pte;
+  uint64 va;
+  int nfreed = 0;
+
+  if(swap.nslot == 0 || myproc() == 0 || !maysleep() ||
+     holdingsleep(&swap.scan) || holdingsleep(&swap.buf.lock))
+    return 0;
+  acquiresleep(&swap.scan);
+  for(int i = 0; i < SWAPSCAN && nfreed < SWAPBATCH && swap.nused < swap.nslot; i++){
+    p = &proc[swap.hand];
+    acquire(&p->lock);
+    pte = 0;
+    if(swappable(p))
+      pte = nextpage(p, &swap.handva, p->vm->sz);
+    if(pte == 0){
+      // done with this process; on to the next.
+      release(&p->lock);
+      swap.hand = (swap.hand + 1) % NPROC;
+      swap.handva = 0;
+      continue;
+    }
+    va = swap.handva;
+    swap.handva += PGSIZE;
+    if((*pte & (PTE_U|PTE_COW)) != PTE_U || krefcnt((void*)PTE2PA(*pte)) != 1 ||
+       vmalookup(p, va, 1) != 0){
+      // not anonymous memory of p's alone.
+    } else if(*pte & PTE_A){
+      // second chance. a TLB entry may hide later uses
+      // until p next gets new ASIDs.
+      *pte &= ~PTE_A;
+    } else {
+      nfreed += evict(p, va, pte);
+    }
+    release(&p->lock);
+  }
+  releasesleep(&swap.scan);
+  return nfreed;
+}
+
+// Print swap usage, for the kstats system call.
+void
+swapstats(void)
+{
+  printf("swap: %d of %d slots used, %ld pages out, %ld in\n",
+         swap.nused, swap.nslot, swap.nout, swap.nin);
+}
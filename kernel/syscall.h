@@ -20,3 +20,13 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_kstats 22
+#define SYS_mmap   23
+#define SYS_munmap 24
+#define SYS_spawn  25
+#define SYS_clone  26
+#define SYS_join   27
+#define SYS_futex_wait 28
+#define SYS_futex_wake 29
+#define SYS_nice   30
+#define SYS_nanosleep 31
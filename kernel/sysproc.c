@@ -38,16 +38,68 @@ sys_wait(void)
   return wait(p);
 }
 
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, stack;
+
+  if(argaddr(0, &fn) < 0 || argaddr(1, &arg) < 0 || argaddr(2, &stack) < 0)
+    return -1;
+  return clone(fn, arg, stack);
+}
+
+uint64
+sys_join(void)
+{
+  int tid;
+  uint64 p;
+
+  if(argint(0, &tid) < 0 || argaddr(1, &p) < 0)
+    return -1;
+  return join(tid, p);
+}
+
+uint64
+sys_futex_wait(void)
+{
+  uint64 addr;
+  int val;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &val) < 0)
+    return -1;
+  return futex_wait(addr, val);
+}
+
+uint64
+sys_futex_wake(void)
+{
+  uint64 addr;
+  int n;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  return futex_wake(addr, n);
+}
+
+uint64
+sys_nice(void)
+{
+  int inc;
+
+  if(argint(0, &inc) < 0)
+    return -1;
+  return nice(inc);
+}
+
 uint64
 sys_sbrk(void)
 {
-  int addr;
+  uint64 addr;
   int n;
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
+  if(growproc(n, &addr) < 0)
     return -1;
   return addr;
 }
@@ -56,21 +108,10 @@ uint64
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   if(argint(0, &n) < 0)
     return -1;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(myproc()->killed){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  return ticksleep(n);
 }
 
 uint64
@@ -83,6 +124,18 @@ sys_kill(void)
   return kill(pid);
 }
 
+// sleep for at least ns nanoseconds, to the resolution of
+// the timer rather than of ticks.
+uint64
+sys_nanosleep(void)
+{
+  uint64 ns, per = 1000000000 / TIMERHZ;
+
+  if(argaddr(0, &ns) < 0)
+    return -1;
+  return timersleep(ns / per + (ns % per != 0));
+}
+
 // return how many clock tick interrupts have occurred
 // since start.
 uint64
@@ -90,8 +143,24 @@ sys_uptime(void)
 {
   uint xticks;
 
+  clockintr();  // in case every CPU is idle, skipping ticks
   acquire(&tickslock);
   xticks = ticks;
   release(&tickslock);
   return xticks;
 }
+
+// print kernel statistics to the console.
+uint64
+sys_kstats(void)
+{
+  kallocstats();
+  slabstats();
+  pcachestats();
+  vmstats();
+  asidstats();
+  schedstats();
+  timerstats();
+  swapstats();
+  return 0;
+}
@@ -0,0 +1,345 @@
+// Timer interrupts, and timers for sleeping processes.
+//
+// Machine mode only forwards timer interrupts: timervec in
+// kernelvec.S turns each into a supervisor software
+// interrupt, and leaves the timer off until the kernel asks,
+// with an ecall, for the next one. A CPU with work asks for
+// its next tick, every TICKCYCLES, or for an earlier
+// interrupt if a timer on its queue expires first. An idle
+// CPU asks only for its timers, and so skips ticks until it
+// has work again; setrunnable() wakes it with timerkick()
+// when there is some. ticks follows the time, not the
+// number of interrupts, so it is right again at the next
+// tick anywhere.
+//
+// nanosleep() puts a timer on the current CPU's queue, in
+// order of expiry, and sleeps on it until timerintr()
+// expires it.
+//
+// sleep() puts a timer, counted in ticks, on a timer wheel,
+// so that clockintr() wakes only the processes whose time
+// has come rather than every sleeper on every tick. The
+// wheel has two levels of WHEELSIZE slots: a timer due
+// within WHEELSIZE ticks goes in the slot of its tick, and
+// one due later in the slot of its run of WHEELSIZE ticks,
+// whose timers move down a level when the run begins. Ones
+// due later still wait on a list that moves down a level
+// each time the second level comes round.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+struct timer {
+  uint64 when;          // r_time(), or tick, at which it expires
+  struct timer *next;
+  struct timer **pprev; // what points to it, on the wheel
+  int expired;
+};
+
+#define WHEELBITS 6
+#define WHEELSIZE (1 << WHEELBITS)
+#define WHEELMASK (WHEELSIZE - 1)
+
+// protected by tickslock.
+static struct {
+  uint now;                              // ticks the wheel has turned to
+  int n;                                 // timers on it
+  struct timer *slot[2][WHEELSIZE];
+  struct timer *far;                     // due WHEELSIZE*WHEELSIZE ticks or more ahead
+} wheel;
+
+// what timervec does for an ecall, in a7.
+#define MSETTIMER 0  // interrupt this hart at time a0
+#define MKICK     1  // interrupt hart a0
+
+struct {
+  uint64 nintr;    // timer interrupts, and kicks
+  uint64 ntick;    // of which were ticks
+  uint64 nskip;    // ticks idle CPUs didn't take
+  uint64 nkick;    // CPUs interrupted by another
+  uint64 nsleep;   // nanosleep()s
+  uint64 nwheel;   // sleep()s
+  uint64 nmove;    // timers moved down the wheel
+} timerstat;
+
+static void
+mcall(uint64 fn, uint64 arg)
+{
+  register uint64 a0 asm("a0") = arg;
+  register uint64 a7 asm("a7") = fn;
+
+  asm volatile("ecall" : "+r" (a0) : "r" (a7) : "memory");
+}
+
+static uint64 wheelnext(void);
+
+// Ask for c's next timer interrupt: its next tick, unless
+// it is idle, when only ticks that the wheel or sleepers on
+// &ticks need; or its first timer, if sooner.
+// c must be this CPU. Caller must hold c->tq.lock.
+static void
+timerarm(struct cpu *c)
+{
+  uint64 when;
+
+  if(!c->idle || sleeping(&ticks))
+    when = c->tq.nexttick;
+  else
+    when = wheelnext();
+  if(c->tq.head && c->tq.head->when < when)
+    when = c->tq.head->when;
+  mcall(MSETTIMER, when);
+}
+
+// Handle a timer interrupt, or a kick from another CPU:
+// expire this CPU's timers, and tick if it is time.
+// Returns 1 if it was a tick.
+int
+timerintr(void)
+{
+  struct cpu *c = mycpu();
+  struct timer *t;
+  uint64 now = r_time(), next;
+  int tick = 0;
+
+  __sync_fetch_and_add(&timerstat.nintr, 1);
+  acquire(&c->tq.lock);
+  while((t = c->tq.head) != 0 && t->when <= now){
+    c->tq.head = t->next;
+    t->expired = 1;
+    wakeup(t);
+  }
+  if(now >= c->tq.nexttick){
+    // ticks come at multiples of TICKCYCLES on every CPU.
+    next = (now / TICKCYCLES + 1) * TICKCYCLES;
+    if(c->tq.nexttick)
+      __sync_fetch_and_add(&timerstat.nskip, (next - c->tq.nexttick) / TICKCYCLES - 1);
+    c->tq.nexttick = next;
+    tick = 1;
+  }
+  timerarm(c);
+  release(&c->tq.lock);
+
+  if(tick){
+    __sync_fetch_and_add(&timerstat.ntick, 1);
+    clockintr();
+  }
+  return tick;
+}
+
+// The scheduler calls this when this CPU goes idle, with
+// c->idle set, to turn its ticks off, and when it has work
+// again, with c->idle clear, to turn them back on. A tick
+// that came due meanwhile comes at once.
+void
+timerset(void)
+{
+  struct cpu *c;
+
+  push_off();
+  c = mycpu();
+  acquire(&c->tq.lock);
+  timerarm(c);
+  release(&c->tq.lock);
+  pop_off();
+}
+
+// Interrupt CPU c: an idle one, waiting in wfi with its
+// ticks off, so that it looks for work, or a busy one, so
+// that its process sees resched.
+void
+timerkick(struct cpu *c)
+{
+  __sync_fetch_and_add(&timerstat.nkick, 1);
+  mcall(MKICK, c - cpus);
+}
+
+// Sleep for cycles of the timer, or until killed.
+// Returns 0, or -1 if killed.
+int
+timersleep(uint64 cycles)
+{
+  struct proc *p = myproc();
+  struct timer t, **tp;
+  struct cpu *c;
+  int r = 0;
+
+  __sync_fetch_and_add(&timerstat.nsleep, 1);
+  t.when = r_time() + cycles;
+  if(t.when < cycles)
+    t.when = -1;  // never
+  t.expired = 0;
+
+  push_off();
+  c = mycpu();
+  acquire(&c->tq.lock);
+  pop_off();
+  for(tp = &c->tq.head; *tp && (*tp)->when <= t.when; tp = &(*tp)->next)
+    ;
+  t.next = *tp;
+  *tp = &t;
+  if(c->tq.head == &t)
+    timerarm(c);
+
+  // p may move to another CPU while it sleeps; its timer
+  // stays on c's queue.
+  while(!t.expired){
+    if(p->killed){
+      for(tp = &c->tq.head; *tp != &t; tp = &(*tp)->next)
+        ;
+      *tp = t.next;
+      r = -1;
+      break;
+    }
+    sleep(&t, &c->tq.lock);
+  }
+  release(&c->tq.lock);
+  return r;
+}
+
+static void
+wheelinsert(struct timer *t)
+{
+  uint64 ahead = t->when - wheel.now;
+  struct timer **l;
+
+  if(ahead < WHEELSIZE)
+    l = &wheel.slot[0][t->when & WHEELMASK];
+  else if(ahead < WHEELSIZE*WHEELSIZE)
+    l = &wheel.slot[1][(t->when >> WHEELBITS) & WHEELMASK];
+  else
+    l = &wheel.far;
+  t->next = *l;
+  if(t->next)
+    t->next->pprev = &t->next;
+  t->pprev = l;
+  *l = t;
+}
+
+static void
+wheelremove(struct timer *t)
+{
+  *t->pprev = t->next;
+  if(t->next)
+    t->next->pprev = t->pprev;
+}
+
+// Put the timers on list *l back on the wheel, each where
+// it now belongs.
+static void
+wheelmove(struct timer **l)
+{
+  struct timer *t = *l, *next;
+
+  *l = 0;
+  for(; t; t = next){
+    next = t->next;
+    wheelinsert(t);
+    timerstat.nmove++;
+  }
+}
+
+// Turn the wheel to tick now, waking the processes whose
+// timers expire on the way. Called by clockintr().
+// Caller must hold tickslock.
+void
+wheelturn(uint now)
+{
+  struct timer *t, *next;
+
+  if(wheel.n == 0){
+    wheel.now = now;
+    return;
+  }
+  while(wheel.now != now){
+    wheel.now++;
+    if((wheel.now & WHEELMASK) == 0){
+      if(((wheel.now >> WHEELBITS) & WHEELMASK) == 0)
+        wheelmove(&wheel.far);
+      wheelmove(&wheel.slot[1][(wheel.now >> WHEELBITS) & WHEELMASK]);
+    }
+    t = wheel.slot[0][wheel.now & WHEELMASK];
+    wheel.slot[0][wheel.now & WHEELMASK] = 0;
+    for(; t; t = next){
+      next = t->next;
+      if(t->when > wheel.now){
+        wheelinsert(t);
+        continue;
+      }
+      t->expired = 1;
+      wheel.n--;
+      wakeup(t);
+    }
+  }
+}
+
+// The time of the tick at which a process sleeping on the
+// wheel must next be looked at: when its first timer
+// expires, or when the second level moves down. -1 if
+// there are no timers.
+static uint64
+wheelnext(void)
+{
+  uint64 when = -1;
+
+  acquire(&tickslock);
+  if(wheel.n > 0){
+    when = ((wheel.now >> WHEELBITS) + 1) << WHEELBITS;
+    for(uint i = 1; i < WHEELSIZE; i++){
+      if(wheel.slot[0][(wheel.now + i) & WHEELMASK]){
+        when = wheel.now + i;
+        break;
+      }
+    }
+    when = ticktime(when);
+  }
+  release(&tickslock);
+  return when;
+}
+
+// Sleep for n ticks, or until killed, for sys_sleep().
+// Returns 0, or -1 if killed.
+int
+ticksleep(uint n)
+{
+  struct proc *p = myproc();
+  struct timer t;
+  int r = 0;
+
+  if(n == 0)
+    return 0;
+  __sync_fetch_and_add(&timerstat.nwheel, 1);
+  clockintr();  // ticks may be behind, if every CPU was idle
+  acquire(&tickslock);
+  t.when = (uint64)ticks + n;
+  t.expired = 0;
+  wheelinsert(&t);
+  wheel.n++;
+  while(!t.expired){
+    if(p->killed){
+      wheelremove(&t);
+      wheel.n--;
+      r = -1;
+      break;
+    }
+    sleep(&t, &tickslock);
+  }
+  release(&tickslock);
+  return r;
+}
+
+// Print timer statistics, for the kstats system call.
+void
+timerstats(void)
+{
+  printf("timer: %ld interrupts, %ld ticks, %ld ticks skipped idle, %ld kicks, %ld nanosleeps\n",
+         timerstat.nintr, timerstat.ntick, timerstat.nskip, timerstat.nkick,
+         timerstat.nsleep);
+  printf("timer: %ld sleeps, %d on the wheel, %ld moved down it\n",
+         timerstat.nwheel, wheel.n, timerstat.nmove);
+}
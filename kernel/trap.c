@@ -8,9 +8,13 @@
 
 struct spinlock tickslock;
 uint ticks;
+static uint64 tick0;  // r_time() / TICKCYCLES at boot
 
 extern char trampoline[], uservec[], userret[];
 
+// in ucopy.S.
+extern char ucopyend[], ucopyfail[];
+
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
 
@@ -20,6 +24,7 @@ void
 trapinit(void)
 {
   initlock(&tickslock, "time");
+  tick0 = r_time() / TICKCYCLES;
 }
 
 // set up to take exceptions and traps while in the kernel.
@@ -67,6 +72,9 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            vmfault(p, r_stval(), r_scause() == 15) == 0){
+    // page fault on lazily allocated or copy-on-write memory.
   } else {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -76,8 +84,9 @@ usertrap(void)
   if(p->killed)
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
+  // give up the CPU if this is a timer interrupt and p's
+  // time slice is up.
+  if(which_dev == 2 && schedtick())
     yield();
 
   usertrapret();
@@ -119,13 +128,13 @@ usertrapret(void)
   w_sepc(p->trapframe->epc);
 
   // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = MAKE_SATP_ASID(p->pagetable, p->asid);
 
   // jump to trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
   uint64 fn = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64,uint64))fn)(TRAPFRAME, satp);
+  ((void (*)(uint64,uint64))fn)(p->trapva, satp);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -143,15 +152,39 @@ kerneltrap()
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
-  if((which_dev = devintr()) == 0){
+  // a trap in ucopy() comes with SUM set, letting the
+  // kernel touch user memory. vmfault() and yield() may
+  // sleep and switch to other kernel code on this hart, so
+  // clear it until the w_sstatus() below restores it.
+  w_sstatus(sstatus & ~SSTATUS_SUM);
+
+  if((scause == 13 || scause == 15) && r_stval() < PLIC &&
+     sepc >= (uint64)ucopy && sepc < (uint64)ucopyend){
+    // ucopy() or ucopystr() touched user memory that isn't
+    // mapped yet, or is copy-on-write. fix it up and retry
+    // the instruction, or make the copy return -1.
+    // vmfault() may sleep, and other traps reload stval.
+    struct proc *p = myproc();
+    uint64 va = r_stval();
+    if(vmfault(p, va, scause == 15) == 0){
+      ukvmsync(p, va, 1);
+    } else {
+      sepc = (uint64)ucopyfail;
+    }
+  } else if((which_dev = devintr()) == 0){
     printf("scause %p\n", scause);
     printf("sepc=%p stval=%p\n", r_sepc(), r_stval());
     panic("kerneltrap");
   }
 
   // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
+  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING && schedtick()){
+    // the interrupted code may hold the physical address
+    // of one of its user pages; see swapreclaim().
+    myproc()->kpreempt = 1;
     yield();
+    myproc()->kpreempt = 0;
+  }
 
   // the yield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
@@ -159,18 +192,40 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
+// Called on every CPU's ticks, and by uptime(). Idle CPUs
+// skip ticks, so set ticks from the time rather than count.
 void
 clockintr()
 {
+  uint t = r_time() / TICKCYCLES - tick0;
+  int boost;
+
+  if(t == ticks)
+    return;
   acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
+  boost = t / BOOSTTICKS != ticks / BOOSTTICKS;
+  if(t > ticks){
+    ticks = t;
+    wheelturn(t);
+    wakeup(&ticks);
+  } else {
+    boost = 0;
+  }
   release(&tickslock);
+  if(boost)
+    schedboost();
+}
+
+// The time at which tick t comes.
+uint64
+ticktime(uint t)
+{
+  return (tick0 + t) * TICKCYCLES;
 }
 
 // check if it's an external interrupt or software interrupt,
 // and handle it.
-// returns 2 if timer interrupt,
+// returns 2 if timer interrupt that was a tick,
 // 1 if other device,
 // 0 if not recognized.
 int
@@ -202,17 +257,18 @@ devintr()
     return 1;
   } else if(scause == 0x8000000000000001L){
     // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // or from another CPU, forwarded by timervec in kernelvec.S.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
-    
     // acknowledge the software interrupt by clearing
-    // the SSIP bit in sip.
+    // the SSIP bit in sip, first, so that one raised
+    // meanwhile isn't lost.
     w_sip(r_sip() & ~2);
 
-    return 2;
+    // 2 has the interrupted process call schedtick(), on
+    // a tick, or if vmshootdown() kicked it to yield.
+    if(timerintr() || (myproc() != 0 && myproc()->resched))
+      return 2;
+    return 1;
   } else {
     return 0;
   }
@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -15,14 +17,32 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+#define TLBPAGES 32  // uvmunmap() flushes more pages than this all at once
+#define SUPERFAULTS 16  // vmfault() promotes 2 MB of heap with this many 4 KB pages
+
+// page fault counts and the time spent handling them.
+struct {
+  uint64 nlazy;   // zero-fill faults on lazily grown memory
+  uint64 ncow;    // copy-on-write faults
+  uint64 nfile;   // pages of programs and mapped files
+  uint64 nbad;    // faults that killed the process
+  uint64 time;    // total r_time() in vmfault()
+  uint64 nsuper;  // live megapage mappings of user memory
+  uint64 nsplit;  // megapages split into 4 KB pages
+  uint64 npromote; // 2 MB regions of heap made megapages by vmfault()
+} vmstat;
+
 /*
  * create a direct-map page table for the kernel.
  */
+static uint64 kvminittime;  // r_time() kvminit() took
+
 void
 kvminit()
 {
-  kernel_pagetable = (pagetable_t) kalloc();
-  memset(kernel_pagetable, 0, PGSIZE);
+  uint64 t0 = r_time();
+
+  kernel_pagetable = (pagetable_t) kzalloc();
 
   // uart registers
   kvmmap(UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -45,6 +65,7 @@ kvminit()
   // map the trampoline for trap entry/exit to
   // the highest virtual address in the kernel.
   kvmmap(TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
+  kvminittime = r_time() - t0;
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -56,6 +77,88 @@ kvminithart()
   sfence_vma();
 }
 
+// Create a kernel page table for a process. It is the
+// kernel's, except that the first gigabyte gets its own
+// level-1 page, so that ukvmsync() can point the entries
+// below PLIC at the process's user memory. The rest is
+// shared with kernel_pagetable, kernel stacks included.
+// CLINT, which only machine mode touches, is left out.
+// returns 0 if out of memory.
+pagetable_t
+ukvmcreate(void)
+{
+  pagetable_t kpt, l1, kl1;
+
+  if((kernel_pagetable[0] & (PTE_V|PTE_R|PTE_W|PTE_X)) != PTE_V)
+    panic("ukvmcreate");
+  if((kpt = (pagetable_t) kalloc()) == 0)
+    return 0;
+  if((l1 = (pagetable_t) kzalloc()) == 0){
+    kfree(kpt);
+    return 0;
+  }
+  memmove(kpt, kernel_pagetable, PGSIZE);
+  kl1 = (pagetable_t) PTE2PA(kernel_pagetable[0]);
+  for(int i = PX(1, PLIC); i < 512; i++)
+    l1[i] = kl1[i];
+  kpt[0] = PA2PTE(l1) | PTE_V;
+  return kpt;
+}
+
+// Free a page table made by ukvmcreate(). The user
+// page-table pages it points to belong to the user
+// page table.
+void
+ukvmfree(pagetable_t kpt)
+{
+  kfree((void*)PTE2PA(kpt[0]));
+  kfree(kpt);
+}
+
+// Make p's kernel page table map p's user memory in
+// [va, va+len), which must lie below PLIC, by copying the
+// user page table's level-1 entries. The level-0 pages are
+// shared, so only a new level-0 page or a megapage added or
+// removed needs a sync. If threads share the memory, the
+// lock keeps a sync from copying an entry that another
+// thread is removing after vmshootdown() cleared it.
+void
+ukvmsync(struct proc *p, uint64 va, uint64 len)
+{
+  struct spinlock *lk = p->vm->ref > 1 ? &p->vm->lock : 0;
+  pagetable_t ul1, kl1;
+  pte_t pte;
+  int changed = 0;
+
+  if(lk)
+    acquire(lk);
+  ul1 = (pagetable_t) PTE2PA(p->pagetable[0]);
+  kl1 = (pagetable_t) PTE2PA(p->kpagetable[0]);
+  for(int i = PX(1, va); i <= PX(1, va + len - 1); i++){
+    pte = (p->pagetable[0] & PTE_V) ? ul1[i] : 0;
+    if(kl1[i] != pte){
+      kl1[i] = pte;
+      changed = 1;
+    }
+  }
+  if(lk)
+    release(lk);
+  if(changed)
+    sfence_vma();
+}
+
+// Remove all user mappings from p's kernel page table,
+// before exec() frees the user page table they point into.
+void
+ukvmclear(struct proc *p)
+{
+  pagetable_t kl1 = (pagetable_t) PTE2PA(p->kpagetable[0]);
+
+  for(int i = 0; i < PX(1, PLIC); i++)
+    kl1[i] = 0;
+  sfence_vma();
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -68,77 +171,141 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A valid PTE with any of R, W or X set is a leaf. At level 1
+// it maps a 2 MB megapage, at level 2 a 1 GB gigapage; walk()
+// returns such a leaf if one covers va.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  int level = 0;
+
+  return walklevel(pagetable, va, alloc, &level);
+}
+
+// Like walk(), but find or create the PTE for va at level
+// *level (0, 1 or 2) rather than always at level 0. If a
+// larger leaf already covers va, return it instead, and set
+// *level to its level.
+pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int *level)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(int l = 2; l > *level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte)){
+        *level = l;
+        return pte;
+      }
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kzalloc()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(*level, va)];
 }
 
 // Look up a virtual address, return the physical address,
-// or 0 if not mapped.
+// or 0 if not mapped. Allocates lazily grown pages of
+// the current process on first use.
 // Can only be used to look up user pages.
 uint64
 walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   uint64 pa;
+  int level = 0;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
-  if(pte == 0)
-    return 0;
-  if((*pte & PTE_V) == 0)
-    return 0;
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte == 0 || (*pte & PTE_V) == 0){
+    // maybe a not-yet-touched page of the current process.
+    struct proc *p = myproc();
+    if(p == 0 || p->pagetable != pagetable || vmfault(p, va, 0) < 0)
+      return 0;
+    // another thread may have unmapped it again since.
+    level = 0;
+    pte = walklevel(pagetable, va, 0, &level);
+    if(pte == 0 || (*pte & PTE_V) == 0)
+      return 0;
+  }
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  // the 4 KB page of a megapage that holds va.
+  pa = PTE2PA(*pte) + (PGROUNDDOWN(va) & (LEVELSIZE(level) - 1));
   return pa;
 }
 
 // add a mapping to the kernel page table.
+// parts of the range whose va and pa are both suitably
+// aligned are mapped with 1 GB or 2 MB leaves.
 // only used when booting.
 // does not flush TLB or enable paging.
 void
 kvmmap(uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kernel_pagetable, va, sz, pa, perm) != 0)
-    panic("kvmmap");
+  uint64 a, last, n;
+  int level;
+
+  a = PGROUNDDOWN(va);
+  last = PGROUNDUP(va + sz);
+  pa = PGROUNDDOWN(pa);
+  while(a < last){
+    for(level = 2; level > 0; level--){
+      n = LEVELSIZE(level);
+      if(a % n == 0 && pa % n == 0 && a + n <= last)
+        break;
+    }
+    n = LEVELSIZE(level);
+    if(mapleaf(kernel_pagetable, a, pa, perm, level) != 0)
+      panic("kvmmap");
+    a += n;
+    pa += n;
+  }
 }
 
 // translate a kernel virtual address to
 // a physical address. only needed for
 // addresses on the stack.
-// assumes va is page aligned.
 uint64
 kvmpa(uint64 va)
 {
-  uint64 off = va % PGSIZE;
   pte_t *pte;
-  uint64 pa;
-  
-  pte = walk(kernel_pagetable, va, 0);
+  int level = 0;
+
+  pte = walklevel(kernel_pagetable, va, 0, &level);
   if(pte == 0)
     panic("kvmpa");
   if((*pte & PTE_V) == 0)
     panic("kvmpa");
-  pa = PTE2PA(*pte);
-  return pa+off;
+  return PTE2PA(*pte) + (va & (LEVELSIZE(level) - 1));
+}
+
+// Create a single leaf PTE at the given level mapping va
+// to pa; both must be aligned to the leaf's size.
+// Returns 0 on success, -1 if walklevel() couldn't
+// allocate a needed page-table page.
+int
+mapleaf(pagetable_t pagetable, uint64 va, uint64 pa, int perm, int level)
+{
+  pte_t *pte;
+  int l = level;
+
+  if((va | pa) & (LEVELSIZE(level) - 1))
+    panic("mapleaf: not aligned");
+  if((pte = walklevel(pagetable, va, 1, &l)) == 0)
+    return -1;
+  if(l != level || (*pte & PTE_V))
+    panic("remap");
+  *pte = PA2PTE(pa) | perm | PTE_V;
+  return 0;
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
@@ -167,31 +334,224 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
+// User memory in 2 MB-aligned regions that are wholly part
+// of the process is backed by a single megapage when the
+// buddy allocator has a free 2 MB block, which saves a
+// page-table page and 511 TLB entries. A megapage mapping
+// holds one reference on each of its 512 4 KB pages, so it
+// can be split into 4 KB mappings without touching the
+// reference counts. A megapage always lies below p->vm->sz;
+// uvmdealloc() splits one the new size would cut in two.
+
+// Return 1 if any of the megapage's 4 KB pages at pa
+// is shared with another mapping.
+static int
+supershared(uint64 pa)
+{
+  for(int i = 0; i < (1 << SUPERORDER); i++)
+    if(krefcnt((void*)(pa + i*PGSIZE)) != 1)
+      return 1;
+  return 0;
+}
+
+// Drop a megapage mapping's references to its pages.
+static void
+superfree(uint64 pa)
+{
+  if(!supershared(pa)){
+    kfree_order((void*)pa, SUPERORDER);
+    return;
+  }
+  for(int i = 0; i < (1 << SUPERORDER); i++)
+    kfree((void*)(pa + i*PGSIZE));
+}
+
+// Try to back the 2 MB-aligned region at va with a zeroed
+// megapage. Nothing in the region may be mapped yet.
+// Returns 0 on success, -1 if the caller should fall
+// back to 4 KB pages.
+static int
+uvmsuper(pagetable_t pagetable, uint64 va, int perm)
+{
+  pte_t *pte;
+  char *mem;
+  int level = 1;
+
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte && (*pte & PTE_V))
+    return -1;  // already has 4 KB pages, or a megapage
+  if((mem = kalloc_order(SUPERORDER)) == 0)
+    return -1;
+  memset(mem, 0, SUPERPGSIZE);
+  if(mapleaf(pagetable, va, (uint64)mem, perm, 1) != 0){
+    kfree_order(mem, SUPERORDER);
+    return -1;
+  }
+  __sync_fetch_and_add(&vmstat.nsuper, 1);
+  return 0;
+}
+
+// The number of 4 KB heap pages mapped in the 2 MB region
+// at va, or -1 if the region can't become a megapage: it
+// is one already, or has a page that is swapped out,
+// copy-on-write, shared, or not read-write-execute.
+static int
+supercount(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  pagetable_t pt;
+  int level = 1, n = 0;
+
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte == 0 || (*pte & PTE_V) == 0 || PTE_LEAF(*pte))
+    return -1;
+  pt = (pagetable_t)PTE2PA(*pte);
+  for(int i = 0; i < 512; i++){
+    if(pt[i] == 0)
+      continue;
+    if((pt[i] & (PTE_V|PTE_R|PTE_W|PTE_X|PTE_U|PTE_COW)) != (PTE_V|PTE_R|PTE_W|PTE_X|PTE_U) ||
+       krefcnt((void*)PTE2PA(pt[i])) != 1)
+      return -1;
+    n++;
+  }
+  return n;
+}
+
+// Replace the 4 KB pages of p's heap in the 2 MB region at
+// va with a megapage holding copies of them. The megapage
+// is allocated and zeroed without the lock, which is
+// held only to copy the pages that are mapped.
+// p must be the current process, with no other threads.
+static void
+uvmpromote(struct proc *p, uint64 va)
+{
+  struct spinlock *lk = &p->vm->lock;
+  pagetable_t pt;
+  pte_t *pte;
+  char *mem;
+  int level = 1;
+
+  if((mem = kalloc_order(SUPERORDER)) == 0)
+    return;
+  memset(mem, 0, SUPERPGSIZE);
+  acquire(lk);
+  // kalloc_order() may have swapped some of the pages out.
+  if(p->vm->ref != 1 || supercount(p->pagetable, va) < 0){
+    release(lk);
+    kfree_order(mem, SUPERORDER);
+    return;
+  }
+  pte = walklevel(p->pagetable, va, 0, &level);
+  pt = (pagetable_t)PTE2PA(*pte);
+  for(int i = 0; i < 512; i++)
+    if(pt[i])
+      memmove(mem + i*PGSIZE, (void*)PTE2PA(pt[i]), PGSIZE);
+  *pte = PA2PTE(mem) | PTE_V|PTE_R|PTE_W|PTE_X|PTE_U;
+  release(lk);
+
+  // p's kernel page table points at pt until synced.
+  sfence_vma();
+  if(va < PLIC)
+    ukvmsync(p, va, SUPERPGSIZE);
+  for(int i = 0; i < 512; i++)
+    if(pt[i])
+      kfree((void*)PTE2PA(pt[i]));
+  kfree(pt);
+  __sync_fetch_and_add(&vmstat.nsuper, 1);
+  __sync_fetch_and_add(&vmstat.npromote, 1);
+}
+
+// Replace the megapage covering va, if any, with a new
+// page-table page of 512 4 KB mappings of the same memory.
+// Returns 0 on success, -1 if out of memory.
+int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  pagetable_t pt;
+  uint64 pa;
+  uint flags;
+  int level = 0;
+
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte == 0 || (*pte & PTE_V) == 0 || level == 0)
+    return 0;
+  if(level != 1)
+    panic("uvmsplit");
+  // kalloc() may swap, and swapreclaim() may split this
+  // megapage itself, so look again afterwards.
+  if((pt = (pagetable_t)kalloc()) == 0)
+    return -1;
+  level = 0;
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte == 0 || (*pte & PTE_V) == 0 || level == 0){
+    kfree(pt);
+    return 0;
+  }
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte);
+  for(int i = 0; i < 512; i++)
+    pt[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(pt) | PTE_V;
+  __sync_fetch_and_sub(&vmstat.nsuper, 1);
+  __sync_fetch_and_add(&vmstat.nsplit, 1);
+  return 0;
+}
+
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never touched, and so
+// never mapped, are skipped. Megapages must be removed
+// whole. The kernel may be reaching the pages through the
+// process's kernel page table, so flush their TLB entries,
+// one by one unless there are many, and only in its
+// address spaces if it is the current process; see
+// asidflush().
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, end;
   pte_t *pte;
+  int level;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+  end = va + npages*PGSIZE;
+  for(a = va; a < end; a += PGSIZE){
+    level = 0;
+    if((pte = walklevel(pagetable, a, 0, &level)) == 0)
+      continue;
+    if(*pte & PTE_SWAP){
+      if(do_free)
+        swapfree(*pte);
+      *pte = 0;
+      continue;
+    }
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
+    if(level > 0){
+      if(level != 1 || a % SUPERPGSIZE != 0 || a + SUPERPGSIZE > end)
+        panic("uvmunmap: partial megapage");
+      if(do_free)
+        superfree(PTE2PA(*pte));
+      *pte = 0;
+      __sync_fetch_and_sub(&vmstat.nsuper, 1);
+      a += SUPERPGSIZE - PGSIZE;
+      continue;
+    }
     if(do_free){
       uint64 pa = PTE2PA(*pte);
       kfree((void*)pa);
     }
     *pte = 0;
+    if(npages <= TLBPAGES)
+      asidflush(pagetable, a);
   }
+  if(npages > TLBPAGES)
+    asidflush(pagetable, -1);
 }
 
 // create an empty user page table.
@@ -200,10 +560,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kzalloc();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -217,8 +576,7 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kzalloc();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -236,12 +594,16 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    if(a % SUPERPGSIZE == 0 && a + SUPERPGSIZE <= newsz &&
+       uvmsuper(pagetable, a, PTE_W|PTE_X|PTE_R|PTE_U) == 0){
+      a += SUPERPGSIZE - PGSIZE;
+      continue;
+    }
+    mem = kzalloc();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -254,7 +616,8 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Returns the new process size, or oldsz if a
+// megapage needed splitting and memory is exhausted.
 uint64
 uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
@@ -262,6 +625,9 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
     return oldsz;
 
   if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)){
+    if(PGROUNDUP(newsz) % SUPERPGSIZE != 0 &&
+       uvmsplit(pagetable, PGROUNDUP(newsz)) < 0)
+      return oldsz;
     int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
     uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
   }
@@ -299,42 +665,398 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, share
+// its memory with a child's page table.
+// Writable pages become read-only copy-on-write
+// pages in both, and are copied by uvmcow() on
+// the first write.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte;
+  return uvmshare(old, new, 0, sz, 1);
+}
+
+// Map the pages of old in [va, va+len) at the same
+// addresses in new. If cow, writable pages become
+// copy-on-write as for uvmcopy(); otherwise both page
+// tables keep write access to the same memory.
+// returns 0 on success, -1 on failure.
+int
+uvmshare(pagetable_t old, pagetable_t new, uint64 va, uint64 len, int cow)
+{
+  pte_t *pte, *npte;
   uint64 pa, i;
   uint flags;
-  char *mem;
+  int level;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+  for(i = va; i < va + len; i += PGSIZE){
+    level = 0;
+    if((pte = walklevel(old, i, 0, &level)) == 0)
+      continue;  // never touched
+    if(*pte & PTE_SWAP){
+      // new gets its own copy when it swaps the page in.
+      if((npte = walk(new, i, 1)) == 0)
+        goto err;
+      *npte = *pte;
+      swapdup(*pte);
+      continue;
+    }
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;
+    if(cow && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    if(level > 0){
+      // share the whole megapage.
+      if(mapleaf(new, i, pa, flags, 1) != 0)
+        goto err;
+      for(int j = 0; j < (1 << SUPERORDER); j++)
+        kref((void*)(pa + j*PGSIZE));
+      __sync_fetch_and_add(&vmstat.nsuper, 1);
+      i += SUPERPGSIZE - PGSIZE;
+      continue;
+    }
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
+    kref((void*)pa);
+  }
+  if(cow)
+    sfence_vma();  // old's TLB entries may still be writable
+  return 0;
+
+ err:
+  uvmunmap(new, va, (i - va) / PGSIZE, 1);
+  return -1;
+}
+
+// Like uvmshare(), but for fork() in a process with other
+// threads, which may hold stale TLB entries for old's PTEs
+// and so keep writing after a page became copy-on-write:
+// new gets a copy of each writable page now, and shares
+// only read-only ones. old's PTEs are left alone.
+// returns 0 on success, -1 on failure.
+int
+uvmdup(pagetable_t old, pagetable_t new, uint64 va, uint64 len)
+{
+  pte_t *pte, *npte;
+  uint64 pa, i;
+  uint flags;
+  char *mem;
+  int level;
+
+  for(i = va; i < va + len; i += PGSIZE){
+    level = 0;
+    if((pte = walklevel(old, i, 0, &level)) == 0)
+      continue;  // never touched
+    if(*pte & PTE_SWAP){
+      if((npte = walk(new, i, 1)) == 0)
+        goto err;
+      *npte = *pte;
+      swapdup(*pte);
+      continue;
     }
+    if((*pte & PTE_V) == 0)
+      continue;
+    // the 4 KB page of a megapage that holds i. not
+    // walkaddr(), which refuses the guard page below the
+    // stack, since uvmclear() took away its PTE_U.
+    pa = PTE2PA(*pte) + (i & (LEVELSIZE(level) - 1));
+    flags = PTE_FLAGS(*pte);
+    if(flags & PTE_W){
+      if((mem = kalloc()) == 0)
+        goto err;
+      memmove(mem, (char*)pa, PGSIZE);
+      if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
+        kfree(mem);
+        goto err;
+      }
+      continue;
+    }
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
+      goto err;
+    kref((void*)pa);
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, va, (i - va) / PGSIZE, 1);
   return -1;
 }
 
+// Get p's memory in [va, va+len) ready for clone() to
+// share it between threads: read back pages swapreclaim()
+// wrote out, and copy copy-on-write pages. Other threads
+// would see both changes to the PTEs late; see
+// vmshootdown().
+// Returns 0, or -1 if out of memory.
+static int
+uvmunshare1(struct proc *p, uint64 va, uint64 len)
+{
+  pte_t *pte;
+  uint64 a;
+  int level;
+
+  for(a = va; a < va + len; a += PGSIZE){
+    level = 0;
+    if((pte = walklevel(p->pagetable, a, 0, &level)) == 0)
+      continue;
+    if((*pte & PTE_SWAP) && vmfault(p, a, 0) < 0)
+      return -1;
+    if((*pte & PTE_COW) && vmfault(p, a, 1) < 0)
+      return -1;
+    // vmfault() may have split a megapage.
+    level = 0;
+    pte = walklevel(p->pagetable, a, 0, &level);
+    if(level > 0)
+      a = (a & ~(LEVELSIZE(level) - 1)) + LEVELSIZE(level) - PGSIZE;
+  }
+  return 0;
+}
+
+// Make the current process's memory safe to share between
+// threads, for clone(). Once there is more than one,
+// swapreclaim() leaves the memory alone and fork() no
+// longer makes it copy-on-write, so this need only be
+// done once.
+// Returns 0, or -1 if out of memory.
+int
+uvmunshare(struct proc *p)
+{
+  struct vma *v;
+
+  if(p->vm->ref > 2)
+    return 0;  // already shared
+  if(uvmunshare1(p, 0, p->vm->sz) < 0)
+    return -1;
+  for(v = p->vm->vma; v < &p->vm->vma[NVMA]; v++)
+    if(v->len && v->addr >= p->vm->sz && uvmunshare1(p, v->addr, v->len) < 0)
+      return -1;
+  return 0;
+}
+
+// Remove npages of mappings starting from va, in memory
+// that p shares with other threads, and free the pages.
+// The other threads may still be using the pages through
+// stale TLB entries, so the mappings move to a scratch page
+// table, from which they are freed after vmshootdown().
+// Megapages must be removed whole, as for uvmunmap().
+void
+uvmunmapthreads(struct proc *p, uint64 va, uint64 npages)
+{
+  pagetable_t tmp;
+  pte_t *pte, *tpte;
+  uint64 a, end = va + npages*PGSIZE;
+  int level, tlevel, moved;
+
+  while(va < end){
+    if((tmp = uvmcreate()) == 0)
+      goto wait;
+    moved = 0;
+    acquire(&p->vm->lock);
+    for(a = va; a < end; a += PGSIZE){
+      level = 0;
+      if((pte = walklevel(p->pagetable, a, 0, &level)) == 0 ||
+         (*pte & (PTE_V|PTE_SWAP)) == 0)
+        continue;
+      tlevel = level;
+      if((tpte = walklevel(tmp, a, 1, &tlevel)) == 0)
+        break;  // out of memory; free these, then go on
+      *tpte = *pte;
+      *pte = 0;
+      moved = 1;
+      if(level > 0)
+        a += SUPERPGSIZE - PGSIZE;
+    }
+    release(&p->vm->lock);
+
+    if(moved){
+      sfence_vma();
+      vmshootdown(p);
+      uvmunmap(tmp, va, (a - va) / PGSIZE, 1);
+    }
+    freewalk(tmp);
+    if(a > va){
+      va = a;
+      continue;
+    }
+  wait:
+    // out of memory for even one page-table page.
+    acquire(&tickslock);
+    sleep(&ticks, &tickslock);
+    release(&tickslock);
+  }
+}
+
+// Give the process its own copy of the copy-on-write
+// page at va, after a write fault or before copyout().
+// If no one else shares the page, just make it writable.
+// A shared megapage is split, and only the 4 KB page
+// holding va is copied.
+// Returns 0 on success, -1 if va is not a copy-on-write
+// page or memory is exhausted.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+  int level = 0;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  if(level > 0){
+    pa = PTE2PA(*pte);
+    if(!supershared(pa)){
+      *pte = PA2PTE(pa) | (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+      asidflush(pagetable, va);
+      return 0;
+    }
+    if(uvmsplit(pagetable, va) < 0)
+      return -1;
+    pte = walk(pagetable, va, 0);
+  }
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  if(krefcnt((void*)pa) == 1){
+    // the other sharers are gone.
+    *pte = PA2PTE(pa) | flags;
+    asidflush(pagetable, va);
+    return 0;
+  }
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  // flush the read-only entry before the kernel, through
+  // the process's kernel page table, retries its write.
+  asidflush(pagetable, va);
+  kfree((void*)pa);
+  return 0;
+}
+
+// Handle a page fault at va in p's address space: read in
+// a page of the program or of a mapped file, or one that
+// was swapped out, give a zeroed
+// page to a lazily grown part of the heap, or copy a
+// copy-on-write page on a write. Called by usertrap()
+// and, for system call arguments, by the copy functions.
+// Returns 0 if the fault was resolved, -1 if the access
+// is invalid or memory is exhausted.
+// Other threads sharing p's memory may fault on the same
+// page at once; p->vm->lock serializes them, except while
+// reading a page in, which sleeps. kalloc() can't swap
+// while the lock is held, so new heap memory is allocated
+// with it released, and the fault looked at again; and if
+// a copy-on-write copy runs out of memory, the fault is
+// retried after swapreclaim().
+int
+vmfault(struct proc *p, uint64 va, int write)
+{
+  struct spinlock *lk = &p->vm->lock;
+  pte_t *pte;
+  char *mem = 0;
+  uint64 sva;
+  uint64 t0 = r_time();
+  int r = -1, oom, promote, tries = 0;
+
+  if(va >= MAXVA)
+    goto out;
+  va = PGROUNDDOWN(va);
+again:
+  oom = 0;
+  acquire(lk);
+  pte = walk(p->pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    if((*pte & PTE_U) && (*pte & (write ? PTE_W : PTE_R))){
+      // already allowed: another thread mapped the page
+      // first, or vmshootdown() cleared p's kernel page table.
+      r = 0;
+    } else if(write && (*pte & (PTE_U|PTE_COW)) == (PTE_U|PTE_COW)){
+      // present, so only a write to a copy-on-write page is ok.
+      if(uvmcow(p->pagetable, va) == 0){
+        __sync_fetch_and_add(&vmstat.ncow, 1);
+        r = 0;
+      } else {
+        oom = 1;
+      }
+    }
+    release(lk);
+  } else if(pte && (*pte & PTE_SWAP)){
+    // swapped out by swapreclaim(), which leaves memory
+    // that threads share alone, so p is the only user.
+    release(lk);
+    r = swapin(pte);
+  } else if(vmalookup(p, va, 1)){
+    // a page of the program or of a mapped file.
+    release(lk);
+    if(mmapfault(p, va, write) == 0){
+      __sync_fetch_and_add(&vmstat.nfile, 1);
+      r = 0;
+    }
+  } else if(va < p->vm->sz){
+    // heap grown by sbrk() but never touched.
+    if(mem == 0){
+      release(lk);
+      if((mem = kzalloc()) == 0)
+        goto out;
+      goto again;
+    }
+    if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) == 0){
+      mem = 0;
+      r = 0;
+    } else {
+      oom = 1;
+    }
+    // once SUPERFAULTS pages of a 2 MB region that is all
+    // heap have been touched, the rest likely will be too.
+    sva = va & ~(SUPERPGSIZE - 1);
+    promote = r == 0 && p->vm->ref == 1 && sva + SUPERPGSIZE <= p->vm->sz &&
+              vmalookup(p, sva, SUPERPGSIZE) == 0 &&
+              supercount(p->pagetable, sva) >= SUPERFAULTS;
+    release(lk);
+    if(r == 0)
+      __sync_fetch_and_add(&vmstat.nlazy, 1);
+    if(promote)
+      uvmpromote(p, sva);
+  } else {
+    release(lk);
+  }
+  if(oom && ++tries < 8 && swapreclaim() > 0)
+    goto again;
+
+out:
+  if(mem)
+    kfree(mem);
+  if(r == 0)
+    asidflush(p->pagetable, va);  // satp switches no longer flush the TLB
+  if(r < 0)
+    __sync_fetch_and_add(&vmstat.nbad, 1);
+  __sync_fetch_and_add(&vmstat.time, r_time() - t0);
+  return r;
+}
+
+// Print page fault statistics, for the kstats system call.
+void
+vmstats(void)
+{
+  uint64 n = vmstat.nlazy + vmstat.ncow + vmstat.nfile;
+
+  printf("vm: %ld lazy faults, %ld cow faults, %ld file faults, "
+         "%ld bad faults, %ld timer ticks per fault\n",
+         vmstat.nlazy, vmstat.ncow, vmstat.nfile, vmstat.nbad,
+         n ? vmstat.time / n : 0);
+  printf("vm: %ld live superpages, %ld split, %ld promoted\n", vmstat.nsuper,
+         vmstat.nsplit, vmstat.npromote);
+  printf("kvminit: %ld timer ticks at boot\n", kvminittime);
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -345,7 +1067,73 @@ uvmclear(pagetable_t pagetable, uint64 va)
   pte = walk(pagetable, va, 0);
   if(pte == 0)
     panic("uvmclear");
-  *pte &= ~PTE_U;
+  // execute-only as well, since the kernel reaches user
+  // memory through the process's kernel page table, where
+  // clearing PTE_U alone would not stop it.
+  *pte = (*pte & ~(PTE_U|PTE_R|PTE_W)) | PTE_X;
+}
+
+// Whether the copy functions can reach [va, va+len) of
+// pagetable directly, rather than by walking it: it must be
+// the current process's memory, and below PLIC so that the
+// process's kernel page table maps it. ucopy() and
+// ucopystr() fault in untouched pages through kerneltrap().
+static int
+ucopyok(pagetable_t pagetable, uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+
+  return len > 0 && va + len > va && va + len <= PLIC &&
+    p != 0 && pagetable == p->pagetable;
+}
+
+// Find the 4 KB page at va for the copy functions or a
+// futex, faulting
+// it in or copying it if it is copy-on-write and write is
+// set, and take a reference to it, which the caller drops
+// with kfree(). Another thread sharing the memory could
+// otherwise unmap and free the page during the copy.
+// Returns the page's physical address, or 0.
+uint64
+uvmhold(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  struct spinlock *lk = 0;
+  uint64 pa = 0;
+  pte_t *pte;
+  int level = 0;
+
+  if(walkaddr(pagetable, va) == 0)
+    return 0;
+  if(p && pagetable == p->pagetable){
+    // copy a copy-on-write page first, without the lock,
+    // under which kalloc() can't swap.
+    if(write && (pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_COW))
+      vmfault(p, va, 1);
+    lk = &p->vm->lock;
+    acquire(lk);
+  }
+  pte = walklevel(pagetable, va, 0, &level);
+  if(write && pte && (*pte & PTE_COW)){
+    if(uvmcow(pagetable, va) < 0)
+      goto out;
+    // uvmcow() may have split a megapage.
+    level = 0;
+    pte = walklevel(pagetable, va, 0, &level);
+  }
+  if(pte == 0 || (*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U))
+    goto out;
+  if(write){
+    if((*pte & PTE_W) == 0)
+      goto out;
+    *pte |= PTE_D;  // for mapped-file writeback
+  }
+  pa = PTE2PA(*pte) + (va & (LEVELSIZE(level) - 1));
+  kref((void*)pa);
+ out:
+  if(lk)
+    release(lk);
+  return pa;
 }
 
 // Copy from kernel to user.
@@ -356,15 +1144,19 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
 
+  if(ucopyok(pagetable, dstva, len)){
+    ukvmsync(myproc(), dstva, len);
+    return ucopy((char*)dstva, src, len);
+  }
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pa0 = uvmhold(pagetable, va0, 1)) == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
     memmove((void *)(pa0 + (dstva - va0)), src, n);
+    kfree((void*)pa0);
 
     len -= n;
     src += n;
@@ -381,15 +1173,21 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
 
+  if(ucopyok(pagetable, srcva, len)){
+    ukvmsync(myproc(), srcva, len);
+    return ucopy(dst, (char*)srcva, len);
+  }
+
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmhold(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
     memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    kfree((void*)pa0);
 
     len -= n;
     dst += n;
@@ -408,9 +1206,14 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   uint64 n, va0, pa0;
   int got_null = 0;
 
+  if(ucopyok(pagetable, srcva, max)){
+    ukvmsync(myproc(), srcva, max);
+    return ucopystr(dst, (char*)srcva, max);
+  }
+
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmhold(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -431,6 +1234,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
       p++;
       dst++;
     }
+    kfree((void*)pa0);
 
     srcva = va0 + PGSIZE;
   }
@@ -0,0 +1,501 @@
+// Kernel micro-benchmarks.
+// bench [name ...] runs the named benchmarks, or all of them,
+// and prints the clock ticks each one took.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define NFORK 200
+#define NREAD 50
+#define FILESZ (200*1024)
+#define NPIPE 2000
+#define NCALL 100000
+#define NPRIME 200000   // primes1, primes4 and primesfork count primes below this
+#define NTHREADS 4
+#define NPROCS 8        // processes for primesfork, one per CPU with CPUS=8
+#define NHOG 8          // CPU-bound processes in the background of shortjobs
+#define NSHORT 50
+#define NSLEEPER 50     // processes asleep in the background of sleepers
+
+char *progname = "bench";
+
+// fork a child that exits at once, with a 4 MB heap
+// the child never touches.
+void
+forkheap(void)
+{
+  char *a = sbrk(4*1024*1024);
+  if(a == (char*)-1){
+    printf("forkheap: sbrk failed\n");
+    exit(1);
+  }
+  for(char *p = a; p < a + 4*1024*1024; p += 4096)
+    *p = 1;
+  for(int i = 0; i < NFORK; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("forkheap: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      exit(0);
+    wait(0);
+  }
+  sbrk(-4*1024*1024);
+}
+
+// fork, then exec a program that exits at once,
+// as sh does for every command.
+void
+forkexec(void)
+{
+  char *argv[] = { progname, "nop", 0 };
+
+  for(int i = 0; i < NFORK; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("forkexec: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      exec(progname, argv);
+      printf("forkexec: exec %s failed\n", progname);
+      exit(1);
+    }
+    wait(0);
+  }
+}
+
+// the same as forkexec, with spawn().
+void
+spawnexec(void)
+{
+  char *argv[] = { progname, "nop", 0 };
+
+  for(int i = 0; i < NFORK; i++){
+    if(spawn(progname, argv, 0) < 0){
+      printf("spawnexec: spawn %s failed\n", progname);
+      exit(1);
+    }
+    wait(0);
+  }
+}
+
+// fork and exec some of the larger UPROGS, with their output
+// going nowhere, to measure exec of programs that touch only
+// a little of themselves.
+void
+execprogs(void)
+{
+  char *progs[][3] = {
+    { "echo", "x", 0 },
+    { "ls", "README", 0 },
+    { "wc", "README", 0 },
+    { "grep", "xyzzy", "README" },
+    { "cat", "nosuchfile", 0 },
+  };
+  int nprog = sizeof(progs) / sizeof(progs[0]);
+
+  for(int i = 0; i < NFORK; i++){
+    char **p = progs[i % nprog];
+    char *argv[] = { p[0], p[1], p[2], 0 };
+    int pid = fork();
+    if(pid < 0){
+      printf("execprogs: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      close(1);
+      close(2);
+      exec(argv[0], argv);
+      exit(1);
+    }
+    wait(0);
+  }
+}
+
+// grow the heap by 64 MB but touch only 1 MB of it.
+void
+sbrktouch(void)
+{
+  for(int i = 0; i < 20; i++){
+    char *a = sbrk(64*1024*1024);
+    if(a == (char*)-1){
+      printf("sbrktouch: sbrk failed\n");
+      exit(1);
+    }
+    for(char *p = a; p < a + 1024*1024; p += 4096)
+      *p = 1;
+    sbrk(-64*1024*1024);
+  }
+}
+
+// make a FILESZ-byte file for the read benchmarks.
+int
+benchfile(void)
+{
+  char buf[512];
+  int fd;
+
+  memset(buf, 'x', sizeof(buf));
+  if((fd = open("benchfile", O_CREATE|O_RDWR)) < 0){
+    printf("bench: cannot create benchfile\n");
+    exit(1);
+  }
+  for(int i = 0; i < FILESZ; i += sizeof(buf))
+    write(fd, buf, sizeof(buf));
+  close(fd);
+  return open("benchfile", O_RDONLY);
+}
+
+// read a file through a 512-byte buffer, as cat did.
+void
+fileread(void)
+{
+  char buf[512];
+  int fd = benchfile(), sum = 0;
+
+  for(int i = 0; i < NREAD; i++){
+    int n;
+    while((n = read(fd, buf, sizeof(buf))) > 0)
+      sum += buf[n-1];
+    close(fd);
+    fd = open("benchfile", O_RDONLY);
+  }
+  close(fd);
+  unlink("benchfile");
+}
+
+// map the same file and read it in place.
+void
+filemmap(void)
+{
+  int fd = benchfile(), sum = 0;
+
+  for(int i = 0; i < NREAD; i++){
+    char *p = mmap(0, FILESZ, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(p == MAP_FAILED){
+      printf("filemmap: mmap failed\n");
+      exit(1);
+    }
+    for(int j = 0; j < FILESZ; j += 512)
+      sum += p[j + 511];
+    munmap(p, FILESZ);
+  }
+  close(fd);
+  unlink("benchfile");
+}
+
+// push 512-byte buffers through a pipe and back, which
+// copies every byte in and out of user memory.
+void
+pipecopy(void)
+{
+  char buf[512];
+  int fds[2];
+
+  if(pipe(fds) < 0){
+    printf("pipecopy: pipe failed\n");
+    exit(1);
+  }
+  memset(buf, 'x', sizeof(buf));
+  for(int i = 0; i < NPIPE; i++){
+    if(write(fds[1], buf, sizeof(buf)) != sizeof(buf) ||
+       read(fds[0], buf, sizeof(buf)) != sizeof(buf)){
+      printf("pipecopy: short transfer\n");
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// make many trivial system calls.
+void
+syscalls(void)
+{
+  for(int i = 0; i < NCALL; i++)
+    getpid();
+}
+
+// bounce a byte between two processes, switching between
+// them each time.
+void
+pingpong(void)
+{
+  int p1[2], p2[2], pid;
+  char c = 0;
+
+  if(pipe(p1) < 0 || pipe(p2) < 0){
+    printf("pingpong: pipe failed\n");
+    exit(1);
+  }
+  if((pid = fork()) < 0){
+    printf("pingpong: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    while(read(p1[0], &c, 1) == 1)
+      write(p2[1], &c, 1);
+    exit(0);
+  }
+  close(p1[0]);
+  close(p2[1]);
+  for(int i = 0; i < NPIPE; i++){
+    write(p1[1], &c, 1);
+    if(read(p2[0], &c, 1) != 1){
+      printf("pingpong: read failed\n");
+      exit(1);
+    }
+  }
+  close(p1[1]);
+  close(p2[0]);
+  wait(0);
+}
+
+// hand the same number of bytes as pipecopy to a child
+// through shared memory, a page at a time, using a pipe
+// only to say when each page is ready.
+void
+shmcopy(void)
+{
+  int ready[2], done[2], pid, sum = 0;
+  char *buf, c = 0;
+
+  buf = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if(buf == MAP_FAILED || pipe(ready) < 0 || pipe(done) < 0){
+    printf("shmcopy: setup failed\n");
+    exit(1);
+  }
+  if((pid = fork()) < 0){
+    printf("shmcopy: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    while(read(ready[0], &c, 1) == 1){
+      for(int j = 0; j < 4096; j += 512)
+        sum += buf[j];
+      write(done[1], &c, 1);
+    }
+    exit(sum == 0);
+  }
+  close(ready[0]);
+  close(done[1]);
+  for(int i = 0; i < NPIPE*512/4096; i++){
+    memset(buf, i + 1, 4096);
+    write(ready[1], &c, 1);
+    read(done[0], &c, 1);
+  }
+  close(ready[1]);
+  close(done[0]);
+  wait(0);
+}
+
+int nprimes[NTHREADS];
+int primestride;
+
+// count, by trial division, the primes below NPRIME among
+// every stride'th number from 2 + t.
+int
+countprimes(int t, int stride)
+{
+  int n = 0, j;
+
+  for(int i = 2 + t; i < NPRIME; i += stride){
+    for(j = 2; j*j <= i && i % j != 0; j++)
+      ;
+    if(j*j > i)
+      n++;
+  }
+  return n;
+}
+
+void
+primecount(void *arg)
+{
+  int t = (uint64)arg;
+
+  nprimes[t] = countprimes(t, primestride);
+  exit(0);
+}
+
+// count the primes below NPRIME with nthread threads.
+void
+primes(int nthread)
+{
+  int tid[NTHREADS], n = 0;
+  char *stacks = sbrk(nthread*4096);
+
+  if(stacks == (char*)-1){
+    printf("primes: sbrk failed\n");
+    exit(1);
+  }
+  primestride = nthread;
+  for(int t = 0; t < nthread; t++){
+    tid[t] = clone(primecount, (void*)(uint64)t, stacks + (t+1)*4096);
+    if(tid[t] < 0){
+      printf("primes: clone failed\n");
+      exit(1);
+    }
+  }
+  for(int t = 0; t < nthread; t++){
+    join(tid[t], 0);
+    n += nprimes[t];
+  }
+  if(n != 17984)
+    printf("primes: counted %d primes\n", n);
+  sbrk(-nthread*4096);
+}
+
+void
+primes1(void)
+{
+  primes(1);
+}
+
+void
+primes4(void)
+{
+  primes(NTHREADS);
+}
+
+// the same count split among NPROCS processes, each
+// returning its share as its exit status, to see how
+// well the scheduler spreads them over the CPUs.
+void
+primesfork(void)
+{
+  int n = 0, xstatus;
+
+  for(int t = 0; t < NPROCS; t++){
+    int pid = fork();
+    if(pid < 0){
+      printf("primesfork: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      exit(countprimes(t, NPROCS));
+  }
+  for(int t = 0; t < NPROCS; t++){
+    wait(&xstatus);
+    n += xstatus;
+  }
+  if(n != 17984)
+    printf("primesfork: counted %d primes\n", n);
+}
+
+// run NSHORT short jobs, each a fork and wait for a child
+// that exits at once, behind NHOG processes that compute
+// forever, as sh does behind grind or usertests. The time
+// is mostly spent waiting for a CPU.
+void
+shortjobs(void)
+{
+  int hog[NHOG];
+
+  for(int i = 0; i < NHOG; i++){
+    if((hog[i] = fork()) < 0){
+      printf("shortjobs: fork failed\n");
+      exit(1);
+    }
+    if(hog[i] == 0)
+      for(;;)
+        ;
+  }
+  // let the hogs sink to the lowest priority: 15 ticks
+  // each, with NHOG sharing the CPUs.
+  sleep(50);
+  for(int i = 0; i < NSHORT; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("shortjobs: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      exit(0);
+    while(wait(0) != pid)
+      ;
+  }
+  for(int i = 0; i < NHOG; i++)
+    kill(hog[i]);
+  for(int i = 0; i < NHOG; i++)
+    wait(0);
+}
+
+// count primes as primes1 does, while NSLEEPER processes
+// sleep, which should cost nothing until they wake.
+void
+sleepers(void)
+{
+  int pid[NSLEEPER];
+
+  for(int i = 0; i < NSLEEPER; i++){
+    if((pid[i] = fork()) < 0){
+      printf("sleepers: fork failed\n");
+      exit(1);
+    }
+    if(pid[i] == 0){
+      sleep(10000);
+      exit(0);
+    }
+  }
+  if(countprimes(0, 1) != 17984)
+    printf("sleepers: wrong count\n");
+  for(int i = 0; i < NSLEEPER; i++)
+    kill(pid[i]);
+  for(int i = 0; i < NSLEEPER; i++)
+    wait(0);
+}
+
+struct bench {
+  void (*f)(void);
+  char *name;
+} benches[] = {
+  { forkheap, "forkheap" },
+  { forkexec, "forkexec" },
+  { spawnexec, "spawnexec" },
+  { execprogs, "execprogs" },
+  { sbrktouch, "sbrktouch" },
+  { fileread, "fileread" },
+  { filemmap, "filemmap" },
+  { pipecopy, "pipecopy" },
+  { shmcopy, "shmcopy" },
+  { syscalls, "syscalls" },
+  { pingpong, "pingpong" },
+  { primes1, "primes1" },
+  { primes4, "primes4" },
+  { primesfork, "primesfork" },
+  { shortjobs, "shortjobs" },
+  { sleepers, "sleepers" },
+  { 0, 0 },
+};
+
+void
+run(struct bench *b)
+{
+  int t0 = uptime();
+  b->f();
+  printf("%s: %d ticks\n", b->name, uptime() - t0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct bench *b;
+
+  progname = argv[0];
+  if(argc == 2 && strcmp(argv[1], "nop") == 0)
+    exit(0);
+
+  for(b = benches; b->f; b++){
+    int want = argc == 1;
+    for(int i = 1; i < argc; i++)
+      if(strcmp(argv[i], b->name) == 0)
+        want = 1;
+    if(want)
+      run(b);
+  }
+  exit(0);
+}
@@ -0,0 +1,12 @@
+// Print kernel statistics to the console.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  kstats();
+  exit(0);
+}
@@ -134,3 +134,87 @@ memcpy(void *dst, const void *src, uint n)
 {
   return memmove(dst, src, n);
 }
+
+int
+usleep(uint us)
+{
+  return nanosleep((uint64)us * 1000);
+}
+
+// Mutexes and condition variables for threads made by
+// clone(), after Drepper's "Futexes Are Tricky". An
+// uncontended lock and unlock make no system calls. A
+// contended lock spins a little, since the holder is often
+// about to let go on another CPU, then sleeps in the kernel.
+
+#define MUTEXSPIN 100
+
+void
+mutex_init(struct mutex *m)
+{
+  m->state = 0;
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+  int c = 0;
+
+  for(int i = 0; i < MUTEXSPIN; i++){
+    if((c = __sync_val_compare_and_swap(&m->state, 0, 1)) == 0)
+      return;
+    if(c == 2)
+      break;  // others are already asleep
+  }
+  // mark the lock as waited for, so that unlock wakes us.
+  if(c != 2)
+    c = __sync_lock_test_and_set(&m->state, 2);
+  while(c != 0){
+    futex_wait(&m->state, 2);
+    c = __sync_lock_test_and_set(&m->state, 2);
+  }
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+  if(__sync_fetch_and_sub(&m->state, 1) != 1){
+    __sync_lock_release(&m->state);
+    futex_wake(&m->state, 1);
+  }
+}
+
+void
+cond_init(struct cond *c)
+{
+  c->seq = 0;
+}
+
+// Wait for cond_signal() or cond_broadcast(). Like all
+// condition variables, may return without either, so
+// callers must recheck their condition.
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+  int seq = c->seq;
+
+  mutex_unlock(m);
+  // a signal since seq was read changed it, and then
+  // futex_wait() returns at once.
+  futex_wait(&c->seq, seq);
+  mutex_lock(m);
+}
+
+void
+cond_signal(struct cond *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futex_wake(&c->seq, 1);
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futex_wake(&c->seq, 0x7fffffff);
+}
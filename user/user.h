@@ -1,6 +1,16 @@
 struct stat;
 struct rtcdate;
 
+// ulib.c's locks for threads, which block in the kernel
+// with futex_wait().
+struct mutex {
+  int state;  // 0 unlocked, 1 locked, 2 locked and maybe waited for
+};
+
+struct cond {
+  int seq;    // bumped by every signal
+};
+
 // system calls
 int fork(void);
 int exit(int) __attribute__((noreturn));
@@ -23,6 +33,16 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int kstats(void);
+void* mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int spawn(char*, char**, int*);
+int clone(void(*)(void*), void*, void*);
+int join(int, int*);
+int futex_wait(int*, int);
+int futex_wake(int*, int);
+int nice(int);
+int nanosleep(uint64);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -40,3 +60,11 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+int usleep(uint);
+void mutex_init(struct mutex*);
+void mutex_lock(struct mutex*);
+void mutex_unlock(struct mutex*);
+void cond_init(struct cond*);
+void cond_wait(struct cond*, struct mutex*);
+void cond_signal(struct cond*);
+void cond_broadcast(struct cond*);
@@ -680,6 +680,355 @@ exectest(char *s)
 
 }
 
+// spawn() echo with its output going to a pipe.
+void
+spawntest(char *s)
+{
+  char *echoargv[] = { "echo", "OK", 0 };
+  int fds[2], cfds[3], pid, xstatus, n, cc;
+  char buf[8];
+
+  if(spawn("nosuchprogram", echoargv, 0) >= 0){
+    printf("%s: spawn of missing program succeeded\n", s);
+    exit(1);
+  }
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  cfds[0] = -1;
+  cfds[1] = fds[1];
+  cfds[2] = 2;
+  pid = spawn("echo", echoargv, cfds);
+  if(pid < 0){
+    printf("%s: spawn echo failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  // echo's only copy of the write end is its fd 1, so
+  // the read sees EOF once echo exits.
+  for(n = 0; (cc = read(fds[0], buf + n, sizeof(buf) - n)) > 0; n += cc)
+    ;
+  if(n != 3 || buf[0] != 'O' || buf[1] != 'K'){
+    printf("%s: wrong output\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: wait failed\n", s);
+    exit(1);
+  }
+}
+
+// threads made by clone() share memory; join() waits
+// for one, and the first thread's exit ends the others.
+volatile int threadcount;
+
+void
+threadinc(void *arg)
+{
+  for(int i = 0; i < (uint64)arg; i++)
+    __sync_fetch_and_add(&threadcount, 1);
+  exit(7);
+}
+
+void
+threadspin(void *arg)
+{
+  for(;;)
+    ;
+}
+
+void
+threadclose(void *arg)
+{
+  close((int)(uint64)arg);
+  exit(0);
+}
+
+// clone a thread, on the stack after this one's, and exit
+// before it does.
+void
+threadnest(void *arg)
+{
+  if(clone(threadinc, (void*)1, (char*)arg + 4096) < 0)
+    exit(1);
+  exit(0);
+}
+
+void
+threadtest(char *s)
+{
+  enum { N=4, STK=4096 };
+  int tid[N], xstatus, pid, fds[2];
+  char *stacks;
+
+  if((stacks = sbrk(N*STK)) == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  threadcount = 0;
+  for(int i = 0; i < N; i++){
+    if((tid[i] = clone(threadinc, (void*)1000, stacks + (i+1)*STK)) < 0){
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+  for(int i = 0; i < N; i++){
+    if(join(tid[i], &xstatus) != tid[i] || xstatus != 7){
+      printf("%s: join failed\n", s);
+      exit(1);
+    }
+  }
+  if(threadcount != N*1000){
+    printf("%s: threads counted %d\n", s, threadcount);
+    exit(1);
+  }
+  if(join(tid[0], 0) != -1 || wait(0) != -1){
+    printf("%s: reaped a thread twice\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(clone(threadspin, 0, stacks + STK) < 0)
+      exit(1);
+    exit(0);
+  }
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: wait failed\n", s);
+    exit(1);
+  }
+
+  // threads share their open files.
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if((tid[0] = clone(threadclose, (void*)(uint64)fds[1], stacks + STK)) < 0 ||
+     join(tid[0], 0) != tid[0]){
+    printf("%s: clone failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  if(write(fds[1], "x", 1) != -1){
+    printf("%s: a thread's close() didn't close the caller's fd\n", s);
+    exit(1);
+  }
+
+  // a thread's thread outlives its creator, and its exit
+  // doesn't end the process.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if((tid[0] = clone(threadnest, stacks + 2*STK, stacks + STK)) < 0)
+      exit(1);
+    if(join(tid[0], &xstatus) != tid[0] || xstatus != 0)
+      exit(1);
+    sleep(5);
+    exit(0);
+  }
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: nested thread ended its process\n", s);
+    exit(1);
+  }
+
+  // fork() while another thread runs copies the memory
+  // they share, exec()'s stack guard page included.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(clone(threadspin, 0, stacks + STK) < 0)
+      exit(1);
+    threadcount = 1234;
+    if((pid = fork()) < 0)
+      exit(1);
+    if(pid == 0){
+      if(threadcount != 1234)
+        exit(1);
+      threadcount = 0;
+      exit(0);
+    }
+    if(wait(&xstatus) != pid || xstatus != 0 || threadcount != 1234)
+      exit(1);
+    exit(0);
+  }
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: fork with a running thread failed\n", s);
+    exit(1);
+  }
+  sbrk(-N*STK);
+}
+
+// threads take turns with a mutex, and hand items over
+// through a condition variable.
+struct mutex futexmu;
+struct cond futexcv;
+int futexsum, futexitems;
+
+void
+futexworker(void *arg)
+{
+  for(int i = 0; i < 1000; i++){
+    mutex_lock(&futexmu);
+    futexsum++;  // not atomic; the mutex must exclude
+    mutex_unlock(&futexmu);
+  }
+  mutex_lock(&futexmu);
+  while(futexitems == 0)
+    cond_wait(&futexcv, &futexmu);
+  futexitems--;
+  mutex_unlock(&futexmu);
+  exit(0);
+}
+
+void
+futextest(char *s)
+{
+  enum { N=4, STK=4096 };
+  int tid[N], x = 1;
+  char *stacks;
+
+  if(futex_wait(&x, 0) != -1){
+    printf("%s: futex_wait on a changed word slept\n", s);
+    exit(1);
+  }
+  if(futex_wake(&x, 1) != 0){
+    printf("%s: futex_wake woke someone\n", s);
+    exit(1);
+  }
+  if((stacks = sbrk(N*STK)) == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  mutex_init(&futexmu);
+  cond_init(&futexcv);
+  futexsum = futexitems = 0;
+  for(int i = 0; i < N; i++){
+    if((tid[i] = clone(futexworker, 0, stacks + (i+1)*STK)) < 0){
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+  }
+  sleep(2);
+  for(int i = 0; i < N; i++){
+    mutex_lock(&futexmu);
+    futexitems++;
+    cond_signal(&futexcv);
+    mutex_unlock(&futexmu);
+  }
+  for(int i = 0; i < N; i++){
+    if(join(tid[i], 0) != tid[i]){
+      printf("%s: join failed\n", s);
+      exit(1);
+    }
+  }
+  if(futexsum != N*1000 || futexitems != 0){
+    printf("%s: sum %d, %d items left\n", s, futexsum, futexitems);
+    exit(1);
+  }
+  sbrk(-N*STK);
+}
+
+// nice() stays within 0 to 19, and children inherit it.
+void
+nicetest(char *s)
+{
+  int pid, xstatus;
+
+  if(nice(0) != 0 || nice(5) != 5 || nice(100) != 19){
+    printf("%s: nice out of range\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(nice(0));
+  wait(&xstatus);
+  if(xstatus != 19 || nice(-100) != 0){
+    printf("%s: nice not inherited or not reset\n", s);
+    exit(1);
+  }
+}
+
+// usleep() sleeps for less than a tick, and for as long as
+// asked, and kill() cuts a nanosleep() short.
+void
+usleeptest(char *s)
+{
+  int pid, t0;
+
+  t0 = uptime();
+  for(int i = 0; i < 20; i++)
+    usleep(1000);
+  if(uptime() - t0 > 2){
+    printf("%s: 20 1ms sleeps took %d ticks\n", s, uptime() - t0);
+    exit(1);
+  }
+  t0 = uptime();
+  usleep(250000);
+  if(uptime() - t0 < 2){
+    printf("%s: 250ms sleep took %d ticks\n", s, uptime() - t0);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    nanosleep(0xffffffffffffffffULL);
+    exit(0);
+  }
+  sleep(1);
+  kill(pid);
+  if(wait(0) != pid){
+    printf("%s: wait failed\n", s);
+    exit(1);
+  }
+}
+
+// sleep() sleeps at least as long as asked, for times on
+// each level of the kernel's timer wheel.
+void
+sleeptest(char *s)
+{
+  int n[] = { 1, 3, 8, 70 }, xstatus;
+
+  for(int i = 0; i < sizeof(n)/sizeof(n[0]); i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      int t0 = uptime();
+      sleep(n[i]);
+      exit(uptime() - t0 < n[i]);
+    }
+  }
+  for(int i = 0; i < sizeof(n)/sizeof(n[0]); i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: woke too soon\n", s);
+      exit(1);
+    }
+  }
+}
+
 // simple fork and pipe read/write
 
 void
@@ -2076,6 +2425,279 @@ sbrkmuch(char *s)
   }
 }
 
+// fork a process that holds most of physical memory. the
+// child's copy would not fit if fork copied eagerly, so this
+// needs copy-on-write. parent and child each write to the
+// shared pages, and neither may see the other's writes.
+void
+cowfork(char *s)
+{
+  enum { BIG=80*1024*1024 };
+  char *a, *p;
+  int pid, xstatus;
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + BIG; p += 4096)
+    *(int*)p = 1;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(p = a; p < a + BIG; p += 64*4096){
+      if(*(int*)p != 1)
+        exit(1);
+      *(int*)p = 2;
+    }
+    for(p = a; p < a + BIG; p += 64*4096)
+      if(*(int*)p != 2)
+        exit(1);
+    exit(0);
+  }
+  for(p = a; p < a + BIG; p += 128*4096)
+    *(int*)p = 3;
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong values\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + BIG; p += 4096){
+    if(*(int*)p != (((p - a) / 4096) % 128 == 0 ? 3 : 1)){
+      printf("%s: parent saw child's write\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-BIG);
+}
+
+// a large heap is mapped with 2 MB megapages where it can be,
+// once enough of each has been touched, keeping what was
+// written to its 4 KB pages. shrinking to a size in the
+// middle of one must split it and keep the part below the
+// new size intact; growing again must give back zeroed
+// memory.
+void
+superpage(char *s)
+{
+  enum { BIG=8*1024*1024, CUT=3*1024*1024+4096 };
+  char *a, *p;
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + BIG; p += 4096)
+    *(int*)p = (p - a) / 4096;
+
+  if(sbrk(-CUT) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + BIG - CUT; p += 4096){
+    if(*(int*)p != (p - a) / 4096){
+      printf("%s: lost a write after shrinking\n", s);
+      exit(1);
+    }
+  }
+
+  sbrk(CUT);
+  for(p = a + BIG - CUT; p < a + BIG; p += 4096){
+    if(*(int*)p != 0){
+      printf("%s: regrown memory not zeroed\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-BIG);
+}
+
+// anonymous mmap(): MAP_SHARED memory is shared with a
+// forked child, even pages first touched after the fork;
+// MAP_PRIVATE memory is not.
+void
+shmtest(char *s)
+{
+  char *shared, *private;
+  int pid, xstatus;
+
+  shared = mmap(0, 3*4096, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  private = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(shared == MAP_FAILED || private == MAP_FAILED){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(shared[0] != 0 || private[100] != 0){
+    printf("%s: anonymous memory not zeroed\n", s);
+    exit(1);
+  }
+  shared[0] = 'a';
+  private[0] = 'a';
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(shared[0] != 'a' || private[0] != 'a')
+      exit(1);
+    shared[0] = 'b';
+    shared[2*4096] = 'c';  // untouched before the fork
+    private[0] = 'b';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong contents\n", s);
+    exit(1);
+  }
+  if(shared[0] != 'b' || shared[2*4096] != 'c'){
+    printf("%s: child's shared writes lost\n", s);
+    exit(1);
+  }
+  if(private[0] != 'a'){
+    printf("%s: child's private write leaked\n", s);
+    exit(1);
+  }
+  munmap(shared, 3*4096);
+  munmap(private, 4096);
+}
+
+// use more memory than the machine has, so that some of it
+// must be swapped out, and check that a forked child sees
+// the swapped-out pages too.
+void
+swaptest(char *s)
+{
+  enum { BIG=136*1024*1024 };
+  char *a, *p;
+  int pid, xstatus;
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + BIG; p += 4096)
+    *(int*)p = (p - a) / 4096;
+  for(p = a; p < a + BIG; p += 4096){
+    if(*(int*)p != (p - a) / 4096){
+      printf("%s: lost a page\n", s);
+      exit(1);
+    }
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(p = a; p < a + BIG; p += 64*4096)
+      if(*(int*)p != (p - a) / 4096)
+        exit(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong contents\n", s);
+    exit(1);
+  }
+  sbrk(-BIG);
+}
+
+// mmap() a file private and shared; writes to the private
+// mapping must not reach the file, writes to the shared one
+// must, once it is unmapped, and a forked child must see
+// the parent's shared writes.
+void
+mmaptest(char *s)
+{
+  enum { SZ=3*4096+100 };
+  char *p, *q;
+  int fd, i, pid, xstatus;
+
+  unlink("mmapfile");
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i += 512){
+    memset(buf, 'a' + (i / 4096), 512);
+    write(fd, buf, i + 512 > SZ ? SZ - i : 512);
+  }
+
+  p = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  q = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED || q == MAP_FAILED){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++){
+    if(p[i] != 'a' + (i / 4096) || q[i] != p[i]){
+      printf("%s: mapping has wrong contents\n", s);
+      exit(1);
+    }
+  }
+  // past the end of the file reads as zeros.
+  if(p[SZ] != 0){
+    printf("%s: mapping not zeroed past end of file\n", s);
+    exit(1);
+  }
+  p[0] = 'X';
+  q[4096] = 'Y';
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(p[0] != 'X' || q[4096] != 'Y')
+      exit(1);
+    q[2*4096] = 'Z';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong values\n", s);
+    exit(1);
+  }
+  if(q[2*4096] != 'Z'){
+    printf("%s: parent missed child's shared write\n", s);
+    exit(1);
+  }
+
+  if(munmap(p, SZ) < 0 || munmap(q, SZ) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, buf, 3*4096) != 3*4096){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(buf[0] != 'a'){
+    printf("%s: private write reached the file\n", s);
+    exit(1);
+  }
+  if(buf[4096] != 'Y' || buf[2*4096] != 'Z'){
+    printf("%s: shared write not written back\n", s);
+    exit(1);
+  }
+  unlink("mmapfile");
+}
+
 // can we read the kernel's memory?
 void
 kernmem(char *s)
@@ -2100,6 +2722,30 @@ kernmem(char *s)
   }
 }
 
+// program text is mapped read-only, and shared with every
+// other process running the program, so writing it must
+// kill the writer.
+void
+textwrite(char *s)
+{
+  int pid, xstatus;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    *(volatile int*)textwrite = 10;
+    exit(1);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){  // did kernel kill child?
+    printf("%s: could write program text\n", s);
+    exit(1);
+  }
+}
+
 // if we run the system out of memory, does it clean up the last
 // failed allocation?
 void
@@ -2364,6 +3010,44 @@ stacktest(char *s)
     exit(xstatus);
 }
 
+// the kernel reaches user memory directly when copying
+// system call arguments; it must still refuse the guard
+// page beneath the stack.
+void
+stackcopy(char *s)
+{
+  char *guard = (char *) (PGROUNDDOWN(r_sp()) - PGSIZE);
+  int fd;
+
+  fd = open("README", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open(README) failed\n", s);
+    exit(1);
+  }
+  if(read(fd, guard, 10) == 10){
+    printf("%s: read into guard page\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("stackcopy", O_CREATE|O_WRONLY);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  if(write(fd, guard, 10) == 10){
+    printf("%s: write from guard page\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("stackcopy");
+
+  if(open(guard, O_RDONLY) >= 0){
+    printf("%s: open with path in guard page\n", s);
+    exit(1);
+  }
+}
+
 // regression test. copyin(), copyout(), and copyinstr() used to cast
 // the virtual page address to uint, which (with certain wild system
 // call arguments) resulted in a kernel page faults.
@@ -2666,16 +3350,29 @@ main(int argc, char *argv[])
     {fourfiles, "fourfiles"},
     {sharedfd, "sharedfd"},
     {exectest, "exectest"},
+    {spawntest, "spawntest"},
+    {threadtest, "threadtest"},
+    {futextest, "futextest"},
+    {nicetest, "nicetest"},
+    {usleeptest, "usleeptest"},
+    {sleeptest, "sleeptest"},
     {bigargtest, "bigargtest"},
     {bigwrite, "bigwrite"},
     {bsstest, "bsstest"},
     {sbrkbasic, "sbrkbasic"},
     {sbrkmuch, "sbrkmuch"},
+    {cowfork, "cowfork"},
+    {superpage, "superpage"},
+    {mmaptest, "mmaptest"},
     {kernmem, "kernmem"},
+    {textwrite, "textwrite"},
     {sbrkfail, "sbrkfail"},
     {sbrkarg, "sbrkarg"},
     {validatetest, "validatetest"},
     {stacktest, "stacktest"},
+    {stackcopy, "stackcopy"},
+    {swaptest, "swaptest"},
+    {shmtest, "shmtest"},
     {opentest, "opentest"},
     {writetest, "writetest"},
     {writebig, "writebig"},
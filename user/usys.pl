@@ -36,3 +36,13 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("kstats");
+entry("mmap");
+entry("munmap");
+entry("spawn");
+entry("clone");
+entry("join");
+entry("futex_wait");
+entry("futex_wake");
+entry("nice");
+entry("nanosleep");
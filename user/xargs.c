@@ -52,18 +52,11 @@ int main(int argc ,char *argv[]){
                 memset(parament[i], '\0', sizeof(parament[i]));
                 ptr[i] = parament[i];
                 parament[i][j] = 0; //the last parament must be 0 #requirement
-                if((pd = fork()) < 0){
-                    printf("error in forking\n");
+                if((pd = spawn(argv[1], ptr + 1, NULL)) < 0){//parament[0] is current_path
+                    printf("error in spawning %s\n", argv[1]);
                     exit(0);
                 }
-                else if(pd == 0){
-                    //subprocess
-                    exec(argv[1], ptr + 1);//parament[0] is current_path
-                }
-                else{
-                    //parent
-                    wait(NULL);
-                }
+                wait(NULL);
                 i = argc;
                 j = 0;
             }